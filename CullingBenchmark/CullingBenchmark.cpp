@@ -0,0 +1,119 @@
+// CullingBenchmark.cpp : Measures the frustum culling kernels against a naive array of structs loop
+//
+// Usage: CullingBenchmark [objectCount]
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include "../VulkanSample/FrustumCulling.h"
+
+struct Sphere {
+	float x, y, z, radius;
+};
+
+// What culling looks like without any data layout work: one object at a time, growing a vector
+static void CullNaive(const Frustum& frustum, const std::vector<Sphere>& spheres, std::vector<uint32_t>& visible) {
+	visible.clear();
+	for (uint32_t i = 0; i < spheres.size(); i++) {
+		const auto& s = spheres[i];
+		bool inside = true;
+		for (const auto& p : frustum.planes) {
+			if (p[0] * s.x + p[1] * s.y + p[2] * s.z + p[3] < -s.radius) {
+				inside = false;
+				break;
+			}
+		}
+		if (inside) {
+			visible.push_back(i);
+		}
+	}
+}
+
+// Column major perspective looking down -z with [0, 1] depth
+static void Perspective(float fovY, float aspect, float nearZ, float farZ, float out[16]) {
+	auto f = 1.0f / std::tan(fovY / 2);
+	std::fill(out, out + 16, 0.0f);
+	out[0] = f / aspect;
+	out[5] = f;
+	out[10] = farZ / (nearZ - farZ);
+	out[11] = -1.0f;
+	out[14] = nearZ * farZ / (nearZ - farZ);
+}
+
+// Best time of several runs, so the first touch of the data and scheduler noise do not count
+static double BestSeconds(const std::function<void()>& run) {
+	constexpr int MIN_RUNS = 5;
+	constexpr double MIN_TOTAL_SECONDS = 0.5;
+	double best = INFINITY;
+	double total = 0.0;
+	for (int i = 0; i < MIN_RUNS || total < MIN_TOTAL_SECONDS; i++) {
+		auto start = std::chrono::steady_clock::now();
+		run();
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		best = std::min(best, elapsed.count());
+		total += elapsed.count();
+	}
+	return best;
+}
+
+static void Report(const std::string& name, uint32_t objectCount, double seconds, double baseline, size_t visible, bool match) {
+	std::cout << std::left << std::setw(28) << name << std::right
+		<< std::setw(10) << std::fixed << std::setprecision(1) << objectCount / seconds / 1e6 << " M objects/s"
+		<< std::setw(8) << std::setprecision(2) << baseline / seconds << "x"
+		<< std::setw(10) << visible << " visible"
+		<< (match ? "" : "  MISMATCH") << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+	uint32_t objectCount = 1000000;
+	if (argc > 1) {
+		objectCount = (uint32_t)std::stoul(argv[1]);
+	}
+
+	// Objects scattered around the camera so roughly a tenth of them are visible
+	std::mt19937 random(1234);
+	std::uniform_real_distribution<float> position(-500.0f, 500.0f);
+	std::uniform_real_distribution<float> size(0.5f, 4.0f);
+	std::vector<Sphere> spheres(objectCount);
+	ObjectBounds bounds;
+	for (auto& s : spheres) {
+		s = { position(random), position(random), position(random), size(random) };
+		bounds.Add(s.x, s.y, s.z, s.radius);
+	}
+	float viewProjection[16];
+	Perspective(1.0f, 16.0f / 9.0f, 0.1f, 1000.0f, viewProjection);
+	auto frustum = ExtractFrustum(viewProjection);
+
+	std::vector<uint32_t> expected;
+	expected.reserve(objectCount);
+	auto baseline = BestSeconds([&] { CullNaive(frustum, spheres, expected); });
+	std::cout << objectCount << " objects, detected " << CullPathName(DetectCullPath()) << std::endl;
+	Report("Naive AoS", objectCount, baseline, baseline, expected.size(), true);
+
+	std::vector<uint32_t> visible(bounds.PaddedCount());
+	for (auto path : { CullPath::Scalar, CullPath::SSE, CullPath::AVX2 }) {
+		if (path > DetectCullPath()) {
+			break;
+		}
+		auto kernel = GetCullKernel(path);
+		uint32_t count = 0;
+		auto seconds = BestSeconds([&] { count = kernel(frustum, bounds, 0, bounds.PaddedCount(), visible.data()); });
+		auto match = std::equal(expected.begin(), expected.end(), visible.begin(), visible.begin() + count) && count == expected.size();
+		Report(std::string("SoA ") + CullPathName(path), objectCount, seconds, baseline, count, match);
+	}
+
+	auto threadCount = std::max(1u, std::thread::hardware_concurrency());
+	FrustumCuller culler(threadCount - 1);
+	std::span<const uint32_t> result;
+	auto seconds = BestSeconds([&] { result = culler.Cull(frustum, bounds); });
+	auto match = std::equal(expected.begin(), expected.end(), result.begin(), result.end());
+	Report(std::string("SoA ") + CullPathName(culler.Path()) + " x" + std::to_string(threadCount) + " threads",
+		objectCount, seconds, baseline, result.size(), match);
+	return 0;
+}
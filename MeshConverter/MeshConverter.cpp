@@ -0,0 +1,389 @@
+// MeshConverter.cpp : Converts Wavefront OBJ files into the sample's binary mesh format
+//
+// Usage: MeshConverter input.obj output.mesh
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <array>
+#include <tuple>
+#include <limits>
+#include <cfloat>
+#include <cstring>
+#include <stdexcept>
+#include "../VulkanSample/MeshFormat.h"
+
+struct Float3 {
+	float x, y, z;
+};
+
+struct Vertex {
+	Float3 position;
+	Float3 normal;
+	float uv[2];
+};
+
+struct Mesh {
+	std::vector<Vertex> vertices;
+	std::vector<uint32_t> indices;
+};
+
+// OBJ indices are 1 based and may be negative (relative to the end)
+static int ResolveIndex(int index, size_t count) {
+	if (index < 0) {
+		return (int)count + index;
+	}
+	return index - 1;
+}
+
+static Mesh LoadObj(const std::string& path) {
+	std::ifstream file(path);
+	if (!file) {
+		throw std::runtime_error("Cannot open " + path);
+	}
+	std::vector<Float3> positions;
+	std::vector<Float3> normals;
+	std::vector<std::array<float, 2>> uvs;
+	// Corners that share position, normal and UV become a single vertex
+	std::map<std::tuple<int, int, int>, uint32_t> corners;
+	Mesh mesh;
+	bool hasNormals = true;
+
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream stream(line);
+		std::string type;
+		stream >> type;
+		if (type == "v") {
+			Float3 p;
+			stream >> p.x >> p.y >> p.z;
+			positions.push_back(p);
+		}
+		else if (type == "vn") {
+			Float3 n;
+			stream >> n.x >> n.y >> n.z;
+			normals.push_back(n);
+		}
+		else if (type == "vt") {
+			std::array<float, 2> t = { 0.0f, 0.0f };
+			stream >> t[0] >> t[1];
+			uvs.push_back(t);
+		}
+		else if (type == "f") {
+			std::vector<uint32_t> face;
+			std::string token;
+			while (stream >> token) {
+				// v, v/vt, v//vn or v/vt/vn
+				int v = 0, vt = 0, vn = 0;
+				auto first = token.find('/');
+				v = std::stoi(token.substr(0, first));
+				if (first != std::string::npos) {
+					auto second = token.find('/', first + 1);
+					auto uvPart = token.substr(first + 1, second == std::string::npos ? std::string::npos : second - first - 1);
+					if (!uvPart.empty()) {
+						vt = std::stoi(uvPart);
+					}
+					if (second != std::string::npos) {
+						vn = std::stoi(token.substr(second + 1));
+					}
+				}
+				auto key = std::make_tuple(
+					ResolveIndex(v, positions.size()),
+					vt != 0 ? ResolveIndex(vt, uvs.size()) : -1,
+					vn != 0 ? ResolveIndex(vn, normals.size()) : -1);
+				auto found = corners.find(key);
+				if (found == corners.end()) {
+					Vertex vertex = {};
+					vertex.position = positions.at(std::get<0>(key));
+					if (std::get<1>(key) >= 0) {
+						vertex.uv[0] = uvs.at(std::get<1>(key))[0];
+						vertex.uv[1] = uvs.at(std::get<1>(key))[1];
+					}
+					if (std::get<2>(key) >= 0) {
+						vertex.normal = normals.at(std::get<2>(key));
+					}
+					else {
+						hasNormals = false;
+					}
+					found = corners.emplace(key, (uint32_t)mesh.vertices.size()).first;
+					mesh.vertices.push_back(vertex);
+				}
+				face.push_back(found->second);
+			}
+			// Triangulate polygons as a fan
+			for (size_t i = 2; i < face.size(); i++) {
+				mesh.indices.push_back(face[0]);
+				mesh.indices.push_back(face[i - 1]);
+				mesh.indices.push_back(face[i]);
+			}
+		}
+	}
+
+	if (!hasNormals) {
+		// Smooth normals from area weighted face normals
+		for (auto& v : mesh.vertices) {
+			v.normal = { 0.0f, 0.0f, 0.0f };
+		}
+		for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+			auto& a = mesh.vertices[mesh.indices[i]];
+			auto& b = mesh.vertices[mesh.indices[i + 1]];
+			auto& c = mesh.vertices[mesh.indices[i + 2]];
+			Float3 e1 = { b.position.x - a.position.x, b.position.y - a.position.y, b.position.z - a.position.z };
+			Float3 e2 = { c.position.x - a.position.x, c.position.y - a.position.y, c.position.z - a.position.z };
+			Float3 n = { e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x };
+			for (auto* v : { &a, &b, &c }) {
+				v->normal.x += n.x;
+				v->normal.y += n.y;
+				v->normal.z += n.z;
+			}
+		}
+	}
+	for (auto& v : mesh.vertices) {
+		auto length = std::sqrt(v.normal.x * v.normal.x + v.normal.y * v.normal.y + v.normal.z * v.normal.z);
+		if (length > 0.0f) {
+			v.normal = { v.normal.x / length, v.normal.y / length, v.normal.z / length };
+		}
+		else {
+			v.normal = { 0.0f, 0.0f, 1.0f };
+		}
+	}
+	return mesh;
+}
+
+// Average number of vertex shader invocations per triangle with a FIFO post-transform cache
+static double AverageCacheMissRatio(const std::vector<uint32_t>& indices, size_t vertexCount, size_t cacheSize) {
+	if (indices.empty()) {
+		return 0.0;
+	}
+	std::vector<size_t> insertedAt(vertexCount, std::numeric_limits<size_t>::max());
+	size_t misses = 0;
+	for (auto index : indices) {
+		if (insertedAt[index] == std::numeric_limits<size_t>::max() || misses - insertedAt[index] >= cacheSize) {
+			insertedAt[index] = misses;
+			misses++;
+		}
+	}
+	return (double)misses / (indices.size() / 3);
+}
+
+// Reorder triangles for the post-transform vertex cache (Forsyth, "Linear-Speed Vertex Cache Optimisation")
+static std::vector<uint32_t> OptimizeVertexCache(const std::vector<uint32_t>& indices, size_t vertexCount) {
+	constexpr int CACHE_SIZE = 32;
+	constexpr float CACHE_DECAY_POWER = 1.5f;
+	constexpr float LAST_TRIANGLE_SCORE = 0.75f;
+	constexpr float VALENCE_BOOST_SCALE = 2.0f;
+	constexpr float VALENCE_BOOST_POWER = 0.5f;
+
+	const size_t triangleCount = indices.size() / 3;
+	std::vector<std::vector<uint32_t>> vertexTriangles(vertexCount);
+	for (size_t t = 0; t < triangleCount; t++) {
+		for (size_t k = 0; k < 3; k++) {
+			vertexTriangles[indices[t * 3 + k]].push_back((uint32_t)t);
+		}
+	}
+	std::vector<int> remaining(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++) {
+		remaining[v] = (int)vertexTriangles[v].size();
+	}
+	std::vector<int> cachePosition(vertexCount, -1);
+	auto vertexScore = [&](uint32_t v) {
+		if (remaining[v] == 0) {
+			return -1.0f;
+		}
+		float score = 0.0f;
+		auto position = cachePosition[v];
+		if (position >= 0) {
+			if (position < 3) {
+				// The triangle we just emitted, these are almost certainly still cached
+				score = LAST_TRIANGLE_SCORE;
+			}
+			else {
+				score = std::pow(1.0f - (float)(position - 3) / (CACHE_SIZE - 3), CACHE_DECAY_POWER);
+			}
+		}
+		// Favor vertices with few triangles left so they don't get stranded
+		score += VALENCE_BOOST_SCALE * std::pow((float)remaining[v], -VALENCE_BOOST_POWER);
+		return score;
+	};
+	std::vector<float> scores(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++) {
+		scores[v] = vertexScore((uint32_t)v);
+	}
+	std::vector<bool> emitted(triangleCount, false);
+	auto triangleScore = [&](uint32_t t) {
+		return scores[indices[t * 3]] + scores[indices[t * 3 + 1]] + scores[indices[t * 3 + 2]];
+	};
+
+	std::vector<uint32_t> result;
+	result.reserve(indices.size());
+	std::vector<uint32_t> cache;
+	size_t scanCursor = 0;
+	for (size_t emittedCount = 0; emittedCount < triangleCount; emittedCount++) {
+		// Best triangle touching the cache, or the next unemitted one when the cache has nothing left
+		int64_t best = -1;
+		float bestScore = -1.0f;
+		for (auto v : cache) {
+			for (auto t : vertexTriangles[v]) {
+				if (!emitted[t] && triangleScore(t) > bestScore) {
+					bestScore = triangleScore(t);
+					best = t;
+				}
+			}
+		}
+		if (best < 0) {
+			while (emitted[scanCursor]) {
+				scanCursor++;
+			}
+			best = (int64_t)scanCursor;
+		}
+		emitted[best] = true;
+		std::vector<uint32_t> newCache;
+		for (size_t k = 0; k < 3; k++) {
+			auto v = indices[best * 3 + k];
+			result.push_back(v);
+			remaining[v]--;
+			newCache.push_back(v);
+		}
+		for (auto v : cache) {
+			if (std::find(newCache.begin(), newCache.end(), v) == newCache.end()) {
+				newCache.push_back(v);
+			}
+		}
+		// Vertices pushed out of the cache lose their cache score
+		for (size_t i = CACHE_SIZE; i < newCache.size(); i++) {
+			cachePosition[newCache[i]] = -1;
+			scores[newCache[i]] = vertexScore(newCache[i]);
+		}
+		if (newCache.size() > CACHE_SIZE) {
+			newCache.resize(CACHE_SIZE);
+		}
+		for (size_t i = 0; i < newCache.size(); i++) {
+			cachePosition[newCache[i]] = (int)i;
+			scores[newCache[i]] = vertexScore(newCache[i]);
+		}
+		cache = std::move(newCache);
+	}
+	return result;
+}
+
+// Renumber vertices in order of first use so vertex fetch walks memory linearly
+static void OptimizeVertexFetch(Mesh& mesh) {
+	std::vector<uint32_t> remap(mesh.vertices.size(), UINT32_MAX);
+	std::vector<Vertex> ordered;
+	ordered.reserve(mesh.vertices.size());
+	for (auto& index : mesh.indices) {
+		if (remap[index] == UINT32_MAX) {
+			remap[index] = (uint32_t)ordered.size();
+			ordered.push_back(mesh.vertices[index]);
+		}
+		index = remap[index];
+	}
+	// Vertices no triangle refers to are dropped
+	mesh.vertices = std::move(ordered);
+}
+
+static std::vector<uint8_t> Encode(const Mesh& mesh) {
+	MeshHeader header = {};
+	header.magic = MESH_MAGIC;
+	header.version = MESH_VERSION;
+	header.vertexCount = (uint32_t)mesh.vertices.size();
+	header.indexCount = (uint32_t)mesh.indices.size();
+	header.indexSize = mesh.vertices.size() <= 65536 ? 2 : 4;
+	header.vertexOffset = AlignMesh(sizeof(MeshHeader));
+	header.indexOffset = AlignMesh(header.vertexOffset + header.vertexCount * sizeof(PackedVertex));
+
+	float minPosition[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float maxPosition[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	float minUv[2] = { FLT_MAX, FLT_MAX };
+	float maxUv[2] = { -FLT_MAX, -FLT_MAX };
+	for (const auto& v : mesh.vertices) {
+		const float p[3] = { v.position.x, v.position.y, v.position.z };
+		for (int i = 0; i < 3; i++) {
+			minPosition[i] = std::min(minPosition[i], p[i]);
+			maxPosition[i] = std::max(maxPosition[i], p[i]);
+		}
+		for (int i = 0; i < 2; i++) {
+			minUv[i] = std::min(minUv[i], v.uv[i]);
+			maxUv[i] = std::max(maxUv[i], v.uv[i]);
+		}
+	}
+	for (int i = 0; i < 3; i++) {
+		header.positionOffset[i] = minPosition[i];
+		header.positionScale[i] = maxPosition[i] - minPosition[i];
+	}
+	for (int i = 0; i < 2; i++) {
+		header.uvOffset[i] = minUv[i];
+		header.uvScale[i] = maxUv[i] - minUv[i];
+	}
+	auto normalize = [](float value, float offset, float scale) {
+		return scale > 0.0f ? (value - offset) / scale : 0.0f;
+	};
+
+	auto size = header.indexOffset + header.indexCount * header.indexSize;
+	std::vector<uint8_t> data(size, 0);
+	memcpy(data.data(), &header, sizeof(header));
+	auto* packed = reinterpret_cast<PackedVertex*>(data.data() + header.vertexOffset);
+	for (size_t i = 0; i < mesh.vertices.size(); i++) {
+		const auto& v = mesh.vertices[i];
+		const float p[3] = { v.position.x, v.position.y, v.position.z };
+		for (int k = 0; k < 3; k++) {
+			packed[i].position[k] = QuantizeUnorm16(normalize(p[k], header.positionOffset[k], header.positionScale[k]));
+		}
+		packed[i].position[3] = 0;
+		const float n[3] = { v.normal.x, v.normal.y, v.normal.z };
+		OctEncode(n, packed[i].normal);
+		for (int k = 0; k < 2; k++) {
+			packed[i].uv[k] = QuantizeUnorm16(normalize(v.uv[k], header.uvOffset[k], header.uvScale[k]));
+		}
+	}
+	for (size_t i = 0; i < mesh.indices.size(); i++) {
+		auto* dst = data.data() + header.indexOffset + i * header.indexSize;
+		if (header.indexSize == 2) {
+			auto index = (uint16_t)mesh.indices[i];
+			memcpy(dst, &index, sizeof(index));
+		}
+		else {
+			memcpy(dst, &mesh.indices[i], sizeof(uint32_t));
+		}
+	}
+	return data;
+}
+
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		std::cerr << "Usage: MeshConverter input.obj output.mesh" << std::endl;
+		return 1;
+	}
+	try {
+		auto mesh = LoadObj(argv[1]);
+		if (mesh.indices.empty()) {
+			std::cerr << "No triangles in " << argv[1] << std::endl;
+			return 1;
+		}
+		constexpr size_t REPORT_CACHE_SIZE = 16;
+		auto before = AverageCacheMissRatio(mesh.indices, mesh.vertices.size(), REPORT_CACHE_SIZE);
+		mesh.indices = OptimizeVertexCache(mesh.indices, mesh.vertices.size());
+		OptimizeVertexFetch(mesh);
+		auto after = AverageCacheMissRatio(mesh.indices, mesh.vertices.size(), REPORT_CACHE_SIZE);
+
+		auto data = Encode(mesh);
+		std::ofstream out(argv[2], std::ios::binary);
+		out.write((const char*)data.data(), data.size());
+		if (!out) {
+			std::cerr << "Failed to write " << argv[2] << std::endl;
+			return 1;
+		}
+		auto unpackedSize = mesh.vertices.size() * sizeof(Vertex) + mesh.indices.size() * sizeof(uint32_t);
+		std::cout << mesh.vertices.size() << " vertices, " << mesh.indices.size() / 3 << " triangles" << std::endl;
+		std::cout << "ACMR " << before << " -> " << after << std::endl;
+		std::cout << data.size() << " bytes (" << unpackedSize << " bytes unquantized)" << std::endl;
+	}
+	catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
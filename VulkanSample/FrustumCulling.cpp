@@ -0,0 +1,343 @@
+// FrustumCulling.cpp : Scalar, SSE and AVX2 sphere culling kernels and the threaded culler
+
+#include "FrustumCulling.h"
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define CULL_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC emits any intrinsic without extra flags
+#define CULL_TARGET_AVX2
+#else
+#include <cpuid.h>
+// GCC and Clang only emit AVX2 inside functions that ask for it, keeping the rest of the file SSE2
+#define CULL_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define CULL_X86 0
+#endif
+
+Frustum ExtractFrustum(const float viewProjection[16]) {
+	auto row = [&](int r, int c) {
+		return viewProjection[c * 4 + r];
+	};
+	Frustum frustum;
+	for (int i = 0; i < 6; i++) {
+		// left, right, bottom, top: w +- x and w +- y. near: z, far: w - z
+		auto axis = i / 2;
+		auto sign = (i % 2 == 0) ? 1.0f : -1.0f;
+		for (int c = 0; c < 4; c++) {
+			float plane;
+			if (i < 4) {
+				plane = row(3, c) + sign * row(axis, c);
+			}
+			else if (i == 4) {
+				plane = row(2, c);
+			}
+			else {
+				plane = row(3, c) - row(2, c);
+			}
+			frustum.planes[i][c] = plane;
+		}
+		auto* p = frustum.planes[i];
+		auto length = std::sqrt(p[0] * p[0] + p[1] * p[1] + p[2] * p[2]);
+		for (int c = 0; c < 4; c++) {
+			p[c] /= length;
+		}
+	}
+	return frustum;
+}
+
+uint32_t ObjectBounds::Add(float x, float y, float z, float radius) {
+	auto index = _count++;
+	if (_count > _x.size()) {
+		// Grow by a whole SIMD lane group of dummy spheres, see Set
+		auto padded = (_count + LANES - 1) / LANES * LANES;
+		_x.resize(padded, 0.0f);
+		_y.resize(padded, 0.0f);
+		_z.resize(padded, 0.0f);
+		_radius.resize(padded, -INFINITY);
+	}
+	Set(index, x, y, z, radius);
+	return index;
+}
+
+// Padding keeps a radius of -infinity, which fails the first plane test
+void ObjectBounds::Set(uint32_t index, float x, float y, float z, float radius) {
+	_x[index] = x;
+	_y[index] = y;
+	_z[index] = z;
+	_radius[index] = radius;
+}
+
+void ObjectBounds::Clear() {
+	_x.clear();
+	_y.clear();
+	_z.clear();
+	_radius.clear();
+	_count = 0;
+}
+
+// Every kernel evaluates dot(n, c) + d in the same order so they agree bit for bit
+static uint32_t CullScalar(const Frustum& frustum, const ObjectBounds& bounds, uint32_t begin, uint32_t end, uint32_t* visible) {
+	const auto* x = bounds.X();
+	const auto* y = bounds.Y();
+	const auto* z = bounds.Z();
+	const auto* radius = bounds.Radius();
+	uint32_t count = 0;
+	for (auto i = begin; i < end; i++) {
+		bool inside = true;
+		for (const auto& p : frustum.planes) {
+			auto distance = p[0] * x[i] + p[1] * y[i] + p[2] * z[i] + p[3];
+			if (distance < -radius[i]) {
+				inside = false;
+				break;
+			}
+		}
+		if (inside) {
+			visible[count++] = i;
+		}
+	}
+	return count;
+}
+
+#if CULL_X86
+static uint32_t CullSSE(const Frustum& frustum, const ObjectBounds& bounds, uint32_t begin, uint32_t end, uint32_t* visible) {
+	__m128 planes[6][4];
+	for (int p = 0; p < 6; p++) {
+		for (int c = 0; c < 4; c++) {
+			planes[p][c] = _mm_set1_ps(frustum.planes[p][c]);
+		}
+	}
+	const auto zero = _mm_setzero_ps();
+	uint32_t count = 0;
+	for (auto i = begin; i < end; i += 4) {
+		auto x = _mm_loadu_ps(bounds.X() + i);
+		auto y = _mm_loadu_ps(bounds.Y() + i);
+		auto z = _mm_loadu_ps(bounds.Z() + i);
+		auto negativeRadius = _mm_sub_ps(zero, _mm_loadu_ps(bounds.Radius() + i));
+		auto inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+		for (const auto& p : planes) {
+			auto distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(p[0], x), _mm_mul_ps(p[1], y)), _mm_mul_ps(p[2], z)), p[3]);
+			inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+		}
+		auto mask = (uint32_t)_mm_movemask_ps(inside);
+		while (mask != 0) {
+			visible[count++] = i + std::countr_zero(mask);
+			mask &= mask - 1;
+		}
+	}
+	return count;
+}
+
+// Lane numbers of the set bits of every 8 bit mask, packed to the front
+static constexpr auto COMPACT_LANES = [] {
+	std::array<std::array<uint8_t, 8>, 256> table = {};
+	for (uint32_t mask = 0; mask < 256; mask++) {
+		uint32_t n = 0;
+		for (uint8_t lane = 0; lane < 8; lane++) {
+			if (mask & (1u << lane)) {
+				table[mask][n++] = lane;
+			}
+		}
+	}
+	return table;
+}();
+
+CULL_TARGET_AVX2
+static uint32_t CullAVX2(const Frustum& frustum, const ObjectBounds& bounds, uint32_t begin, uint32_t end, uint32_t* visible) {
+	__m256 planes[6][4];
+	for (int p = 0; p < 6; p++) {
+		for (int c = 0; c < 4; c++) {
+			planes[p][c] = _mm256_set1_ps(frustum.planes[p][c]);
+		}
+	}
+	const auto zero = _mm256_setzero_ps();
+	uint32_t count = 0;
+	for (auto i = begin; i < end; i += 8) {
+		auto x = _mm256_loadu_ps(bounds.X() + i);
+		auto y = _mm256_loadu_ps(bounds.Y() + i);
+		auto z = _mm256_loadu_ps(bounds.Z() + i);
+		auto negativeRadius = _mm256_sub_ps(zero, _mm256_loadu_ps(bounds.Radius() + i));
+		auto inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (const auto& p : planes) {
+			auto distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(p[0], x), _mm256_mul_ps(p[1], y)), _mm256_mul_ps(p[2], z)), p[3]);
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+		}
+		// Branchless left pack: always store 8 indices and advance by the visible count.
+		// The store stays inside [begin, end) because count never exceeds i - begin.
+		auto mask = (uint32_t)_mm256_movemask_ps(inside);
+		auto lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)COMPACT_LANES[mask].data()));
+		_mm256_storeu_si256((__m256i*)(visible + count), _mm256_add_epi32(lanes, _mm256_set1_epi32((int)i)));
+		count += std::popcount(mask);
+	}
+	return count;
+}
+
+static void Cpuid(uint32_t leaf, uint32_t subleaf, uint32_t registers[4]) {
+#ifdef _MSC_VER
+	int info[4];
+	__cpuidex(info, (int)leaf, (int)subleaf);
+	memcpy(registers, info, sizeof(info));
+#else
+	__cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+}
+
+static uint64_t ReadXcr0() {
+#ifdef _MSC_VER
+	return _xgetbv(0);
+#else
+	uint32_t eax, edx;
+	__asm__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif
+
+CullPath DetectCullPath() {
+#if CULL_X86
+	uint32_t registers[4];
+	Cpuid(0, 0, registers);
+	auto maxLeaf = registers[0];
+	Cpuid(1, 0, registers);
+	auto osxsave = (registers[2] & (1u << 27)) != 0;
+	auto avx = (registers[2] & (1u << 28)) != 0;
+	// The OS must also save the YMM registers on context switches
+	if (maxLeaf >= 7 && osxsave && avx && (ReadXcr0() & 0x6) == 0x6) {
+		Cpuid(7, 0, registers);
+		if (registers[1] & (1u << 5)) {
+			return CullPath::AVX2;
+		}
+	}
+	// SSE2 is part of x64
+	return CullPath::SSE;
+#else
+	return CullPath::Scalar;
+#endif
+}
+
+CullKernel GetCullKernel(CullPath path) {
+	switch (path) {
+#if CULL_X86
+	case CullPath::AVX2:
+		return CullAVX2;
+	case CullPath::SSE:
+		return CullSSE;
+#endif
+	default:
+		return CullScalar;
+	}
+}
+
+const char* CullPathName(CullPath path) {
+	switch (path) {
+	case CullPath::AVX2:
+		return "AVX2";
+	case CullPath::SSE:
+		return "SSE";
+	default:
+		return "Scalar";
+	}
+}
+
+FrustumCuller::FrustumCuller(uint32_t workerCount, CullPath path)
+	: _path(path)
+	, _kernel(GetCullKernel(path)) {
+	for (uint32_t i = 0; i < workerCount; i++) {
+		_workers.emplace_back(&FrustumCuller::WorkerMain, this);
+	}
+}
+
+FrustumCuller::~FrustumCuller() {
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_quit = true;
+	}
+	_start.notify_all();
+	for (auto& worker : _workers) {
+		worker.join();
+	}
+}
+
+std::span<const uint32_t> FrustumCuller::Cull(const Frustum& frustum, const ObjectBounds& bounds) {
+	auto padded = bounds.PaddedCount();
+	if (_visible.size() < padded) {
+		_visible.resize(padded);
+	}
+	auto chunkCount = (padded + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	if (chunkCount <= 1 || _workers.empty()) {
+		auto count = _kernel(frustum, bounds, 0, padded, _visible.data());
+		return std::span<const uint32_t>(_visible.data(), count);
+	}
+	if (_chunkVisible.size() < chunkCount) {
+		_chunkVisible.resize(chunkCount);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_frustum = &frustum;
+		_bounds = &bounds;
+		_chunkCount = chunkCount;
+		_nextChunk = 0;
+		_activeWorkers = (uint32_t)_workers.size();
+		_generation++;
+	}
+	_start.notify_all();
+	ProcessChunks();
+	{
+		std::unique_lock<std::mutex> lock(_mutex);
+		_done.wait(lock, [&] { return _activeWorkers == 0; });
+	}
+
+	// Each chunk wrote its indices at the start of its own range. Slide them down in order.
+	uint32_t count = 0;
+	for (uint32_t c = 0; c < chunkCount; c++) {
+		auto source = c * CHUNK_SIZE;
+		if (source != count) {
+			memmove(_visible.data() + count, _visible.data() + source, _chunkVisible[c] * sizeof(uint32_t));
+		}
+		count += _chunkVisible[c];
+	}
+	return std::span<const uint32_t>(_visible.data(), count);
+}
+
+void FrustumCuller::WorkerMain() {
+	uint64_t seen = 0;
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_start.wait(lock, [&] { return _quit || _generation != seen; });
+			if (_quit) {
+				return;
+			}
+			seen = _generation;
+		}
+		ProcessChunks();
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			if (--_activeWorkers == 0) {
+				_done.notify_one();
+			}
+		}
+	}
+}
+
+void FrustumCuller::ProcessChunks() {
+	auto padded = _bounds->PaddedCount();
+	for (;;) {
+		auto c = _nextChunk.fetch_add(1);
+		if (c >= _chunkCount) {
+			return;
+		}
+		auto begin = c * CHUNK_SIZE;
+		auto end = std::min(begin + CHUNK_SIZE, padded);
+		_chunkVisible[c] = _kernel(*_frustum, *_bounds, begin, end, _visible.data() + begin);
+	}
+}
@@ -0,0 +1,117 @@
+// FrustumCulling.h : CPU visibility test of bounding spheres against a view frustum
+//
+// Bounds are stored as structure of arrays so one SIMD instruction tests 4 (SSE) or 8 (AVX2) objects.
+// The kernel is picked at runtime from what the CPU supports, and FrustumCuller splits the work across
+// threads and returns a compact list of visible object indices for command recording.
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <span>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+// Planes as (nx, ny, nz, d) with unit normals pointing inside, so a point p is inside when dot(n, p) + d >= 0
+struct Frustum {
+	float planes[6][4];
+};
+
+// Planes of a column major view projection matrix with Vulkan's [0, 1] clip depth
+Frustum ExtractFrustum(const float viewProjection[16]);
+
+class ObjectBounds {
+public:
+	// Arrays are padded to a multiple of this with spheres that are never visible
+	static constexpr uint32_t LANES = 8;
+
+	uint32_t Add(float x, float y, float z, float radius);
+	void Set(uint32_t index, float x, float y, float z, float radius);
+	void Clear();
+
+	uint32_t Count() const {
+		return _count;
+	}
+	uint32_t PaddedCount() const {
+		return (uint32_t)_x.size();
+	}
+	const float* X() const {
+		return _x.data();
+	}
+	const float* Y() const {
+		return _y.data();
+	}
+	const float* Z() const {
+		return _z.data();
+	}
+	const float* Radius() const {
+		return _radius.data();
+	}
+
+private:
+	std::vector<float> _x;
+	std::vector<float> _y;
+	std::vector<float> _z;
+	std::vector<float> _radius;
+	uint32_t _count = 0;
+};
+
+enum class CullPath {
+	Scalar,
+	SSE,
+	AVX2,
+};
+
+// Writes the indices of visible objects in [begin, end) to visible and returns how many there are.
+// begin and end must be multiples of ObjectBounds::LANES, and visible must have room for end - begin entries.
+using CullKernel = uint32_t(*)(const Frustum& frustum, const ObjectBounds& bounds, uint32_t begin, uint32_t end, uint32_t* visible);
+
+CullPath DetectCullPath();
+CullKernel GetCullKernel(CullPath path);
+const char* CullPathName(CullPath path);
+
+class FrustumCuller {
+public:
+	// The calling thread takes part in culling, so workerCount = 0 culls on the caller only
+	FrustumCuller(uint32_t workerCount, CullPath path = DetectCullPath());
+	~FrustumCuller();
+	FrustumCuller(const FrustumCuller&) = delete;
+	FrustumCuller& operator=(const FrustumCuller&) = delete;
+
+	// Indices of visible objects in ascending order, valid until the next call
+	std::span<const uint32_t> Cull(const Frustum& frustum, const ObjectBounds& bounds);
+
+	CullPath Path() const {
+		return _path;
+	}
+	uint32_t ThreadCount() const {
+		return (uint32_t)_workers.size() + 1;
+	}
+
+private:
+	// Objects per chunk handed to a thread. Small enough to balance, large enough to keep sync cheap.
+	static constexpr uint32_t CHUNK_SIZE = 4096;
+
+	void WorkerMain();
+	void ProcessChunks();
+
+	CullPath _path;
+	CullKernel _kernel;
+	std::vector<std::thread> _workers;
+	std::mutex _mutex;
+	std::condition_variable _start;
+	std::condition_variable _done;
+	uint64_t _generation = 0;
+	uint32_t _activeWorkers = 0;
+	bool _quit = false;
+
+	// State of the current Cull call, published to workers under _mutex
+	const Frustum* _frustum = nullptr;
+	const ObjectBounds* _bounds = nullptr;
+	uint32_t _chunkCount = 0;
+	std::atomic<uint32_t> _nextChunk = 0;
+	std::vector<uint32_t> _chunkVisible;
+	std::vector<uint32_t> _visible;
+};
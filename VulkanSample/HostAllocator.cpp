@@ -0,0 +1,315 @@
+// HostAllocator.cpp : Arena, size class pools and per scope counters behind VkAllocationCallbacks
+
+#include "HostAllocator.h"
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+namespace {
+
+enum class Source : uint8_t {
+	Arena,
+	Pool,
+	Heap,
+};
+
+// Sits right before every pointer handed to the driver
+struct Header {
+	uint32_t size;
+	uint16_t offset; // From the start of the block to the pointer
+	Source source;
+	uint8_t scope;
+	void* owner;     // Arena of an arena allocation
+};
+static_assert(sizeof(Header) == 16, "Header must keep 16 byte alignment");
+
+// Allocations that don't fit in the rest of the arena, or need more alignment, skip it
+constexpr size_t ARENA_SIZE = 256 * 1024;
+constexpr size_t ARENA_ALIGNMENT = 64;
+
+// Command scope allocations are normally freed on the thread that made them before the call returns.
+// Frees only count down, and the owning thread rewinds the arena on its next allocation once nothing is live,
+// so a free from another thread stays safe. The arena counts one reference per live allocation plus one for
+// the owning thread and is deleted by whoever lets go last, which may be a free after the thread has exited.
+struct Arena {
+	uint8_t* data = nullptr;
+	size_t offset = 0;
+	std::atomic<uint32_t> references = 1;
+
+	bool Idle() const {
+		return references.load(std::memory_order_acquire) == 1;
+	}
+
+	void Release() {
+		if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			::operator delete(data, std::align_val_t(ARENA_ALIGNMENT));
+			delete this;
+		}
+	}
+};
+
+// The owning thread's reference, dropped when the thread exits
+struct ThreadArena {
+	Arena* arena = nullptr;
+
+	~ThreadArena() {
+		if (arena != nullptr) {
+			arena->Release();
+		}
+	}
+
+	Arena& Get() {
+		if (arena == nullptr) {
+			arena = new Arena();
+			arena->data = static_cast<uint8_t*>(::operator new(ARENA_SIZE, std::align_val_t(ARENA_ALIGNMENT)));
+		}
+		return *arena;
+	}
+};
+
+thread_local ThreadArena threadArena;
+
+size_t AlignUp(size_t value, size_t alignment) {
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+Header* HeaderOf(void* memory) {
+	return reinterpret_cast<Header*>(static_cast<uint8_t*>(memory) - sizeof(Header));
+}
+
+// Pointer offset inside a block: the header always fits in front and the pointer honors the alignment
+size_t PointerOffset(size_t alignment) {
+	return std::max(sizeof(Header), alignment);
+}
+
+} // namespace
+
+uint64_t HostAllocator::Counters::TotalCalls() const {
+	uint64_t total = 0;
+	for (auto c : calls) {
+		total += c;
+	}
+	return total;
+}
+
+HostAllocator::Counters HostAllocator::Counters::Since(const Counters& earlier) const {
+	Counters delta;
+	for (size_t i = 0; i < SCOPE_COUNT; i++) {
+		delta.calls[i] = calls[i] - earlier.calls[i];
+		delta.bytes[i] = bytes[i] - earlier.bytes[i];
+		delta.liveBytes[i] = liveBytes[i] - earlier.liveBytes[i];
+	}
+	delta.frees = frees - earlier.frees;
+	delta.arenaOverflows = arenaOverflows - earlier.arenaOverflows;
+	delta.heapCalls = heapCalls - earlier.heapCalls;
+	delta.internalCalls = internalCalls - earlier.internalCalls;
+	delta.internalBytes = internalBytes - earlier.internalBytes;
+	return delta;
+}
+
+HostAllocator::HostAllocator() {
+	_callbacks.pUserData = this;
+	_callbacks.pfnAllocation = AllocationCallback;
+	_callbacks.pfnReallocation = ReallocationCallback;
+	_callbacks.pfnFree = FreeCallback;
+	_callbacks.pfnInternalAllocation = InternalAllocationCallback;
+	_callbacks.pfnInternalFree = InternalFreeCallback;
+}
+
+HostAllocator::~HostAllocator() {
+	for (auto& pool : _pools) {
+		for (auto* slab : pool.slabs) {
+			::operator delete(slab, std::align_val_t(BLOCK_ALIGNMENT));
+		}
+	}
+}
+
+HostAllocator::Counters HostAllocator::Snapshot() const {
+	Counters counters;
+	for (size_t i = 0; i < SCOPE_COUNT; i++) {
+		counters.calls[i] = _calls[i].load(std::memory_order_relaxed);
+		counters.bytes[i] = _bytes[i].load(std::memory_order_relaxed);
+		counters.liveBytes[i] = _liveBytes[i].load(std::memory_order_relaxed);
+	}
+	counters.frees = _frees.load(std::memory_order_relaxed);
+	counters.arenaOverflows = _arenaOverflows.load(std::memory_order_relaxed);
+	counters.heapCalls = _heapCalls.load(std::memory_order_relaxed);
+	counters.internalCalls = _internalCalls.load(std::memory_order_relaxed);
+	counters.internalBytes = _internalBytes.load(std::memory_order_relaxed);
+	return counters;
+}
+
+void HostAllocator::Print(std::ostream& out, const Counters& counters) {
+	static const char* SCOPE_NAMES[SCOPE_COUNT] = { "command", "object", "cache", "device", "instance" };
+	for (size_t i = 0; i < SCOPE_COUNT; i++) {
+		out << "  " << SCOPE_NAMES[i] << ": " << counters.calls[i] << " calls, " << counters.bytes[i] / 1024
+			<< " KiB requested, " << counters.liveBytes[i] / 1024 << " KiB live" << std::endl;
+	}
+	out << "  " << counters.frees << " frees, " << counters.heapCalls << " from the heap, "
+		<< counters.arenaOverflows << " arena overflows, " << counters.internalCalls << " internal ("
+		<< counters.internalBytes / 1024 << " KiB)" << std::endl;
+}
+
+void* HostAllocator::Allocate(size_t size, size_t alignment, VkSystemAllocationScope scope) {
+	if (size == 0 || size > UINT32_MAX) {
+		return nullptr;
+	}
+	alignment = std::max<size_t>(alignment, 1);
+	auto offset = PointerOffset(alignment);
+	if (offset > UINT16_MAX) {
+		return nullptr;
+	}
+	_calls[scope].fetch_add(1, std::memory_order_relaxed);
+	_bytes[scope].fetch_add(size, std::memory_order_relaxed);
+	_liveBytes[scope].fetch_add(size, std::memory_order_relaxed);
+
+	uint8_t* memory = nullptr;
+	Source source = Source::Heap;
+	void* owner = nullptr;
+	if (scope == VK_SYSTEM_ALLOCATION_SCOPE_COMMAND && alignment <= ARENA_ALIGNMENT) {
+		auto& arena = threadArena.Get();
+		if (arena.Idle()) {
+			arena.offset = 0;
+		}
+		// The header sits right before the pointer, so the pointer keeps at least the header's alignment
+		auto start = AlignUp(arena.offset + sizeof(Header), std::max(alignment, alignof(Header))) - sizeof(Header);
+		if (start + sizeof(Header) + size <= ARENA_SIZE) {
+			memory = arena.data + start + sizeof(Header);
+			arena.offset = start + sizeof(Header) + size;
+			arena.references.fetch_add(1, std::memory_order_relaxed);
+			source = Source::Arena;
+			owner = &arena;
+			offset = sizeof(Header);
+		}
+		else {
+			_arenaOverflows.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	if (memory == nullptr && alignment <= BLOCK_ALIGNMENT) {
+		auto needed = offset + size;
+		auto sizeClass = std::find_if(SIZE_CLASSES.begin(), SIZE_CLASSES.end(), [&](size_t s) { return s >= needed; });
+		if (sizeClass != SIZE_CLASSES.end()) {
+			auto* block = static_cast<uint8_t*>(AllocateFromPool(sizeClass - SIZE_CLASSES.begin()));
+			if (block != nullptr) {
+				memory = block + offset;
+				source = Source::Pool;
+			}
+		}
+	}
+	if (memory == nullptr) {
+		auto blockAlignment = std::max(alignment, sizeof(Header));
+		auto* block = static_cast<uint8_t*>(::operator new(offset + size, std::align_val_t(blockAlignment), std::nothrow));
+		if (block == nullptr) {
+			_calls[scope].fetch_sub(1, std::memory_order_relaxed);
+			_bytes[scope].fetch_sub(size, std::memory_order_relaxed);
+			_liveBytes[scope].fetch_sub(size, std::memory_order_relaxed);
+			return nullptr;
+		}
+		_heapCalls.fetch_add(1, std::memory_order_relaxed);
+		memory = block + offset;
+		source = Source::Heap;
+	}
+
+	auto* header = HeaderOf(memory);
+	header->size = (uint32_t)size;
+	header->offset = (uint16_t)offset;
+	header->source = source;
+	header->scope = (uint8_t)scope;
+	header->owner = owner;
+	return memory;
+}
+
+void* HostAllocator::Reallocate(void* original, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+	if (original == nullptr) {
+		return Allocate(size, alignment, scope);
+	}
+	if (size == 0) {
+		Free(original);
+		return nullptr;
+	}
+	auto* memory = Allocate(size, alignment, scope);
+	if (memory == nullptr) {
+		// The original stays valid on failure
+		return nullptr;
+	}
+	memcpy(memory, original, std::min<size_t>(size, HeaderOf(original)->size));
+	Free(original);
+	return memory;
+}
+
+void HostAllocator::Free(void* memory) {
+	if (memory == nullptr) {
+		return;
+	}
+	auto* header = HeaderOf(memory);
+	_frees.fetch_add(1, std::memory_order_relaxed);
+	_liveBytes[header->scope].fetch_sub(header->size, std::memory_order_relaxed);
+	auto* block = static_cast<uint8_t*>(memory) - header->offset;
+	switch (header->source) {
+	case Source::Arena:
+		static_cast<Arena*>(header->owner)->Release();
+		break;
+	case Source::Pool: {
+		auto needed = header->offset + (size_t)header->size;
+		auto sizeClass = std::find_if(SIZE_CLASSES.begin(), SIZE_CLASSES.end(), [&](size_t s) { return s >= needed; });
+		ReturnToPool(sizeClass - SIZE_CLASSES.begin(), block);
+		break;
+	}
+	case Source::Heap:
+		// The offset is also the alignment the block was allocated with
+		::operator delete(block, std::align_val_t(header->offset));
+		break;
+	}
+}
+
+void* HostAllocator::AllocateFromPool(size_t sizeClass) {
+	auto& pool = _pools[sizeClass];
+	std::lock_guard<std::mutex> lock(pool.mutex);
+	if (pool.freeList == nullptr) {
+		auto* slab = static_cast<uint8_t*>(::operator new(SLAB_SIZE, std::align_val_t(BLOCK_ALIGNMENT), std::nothrow));
+		if (slab == nullptr) {
+			return nullptr;
+		}
+		_heapCalls.fetch_add(1, std::memory_order_relaxed);
+		pool.slabs.push_back(slab);
+		auto blockSize = SIZE_CLASSES[sizeClass];
+		for (size_t offset = 0; offset + blockSize <= SLAB_SIZE; offset += blockSize) {
+			auto* block = slab + offset;
+			*reinterpret_cast<void**>(block) = pool.freeList;
+			pool.freeList = block;
+		}
+	}
+	auto* block = pool.freeList;
+	pool.freeList = *reinterpret_cast<void**>(block);
+	return block;
+}
+
+void HostAllocator::ReturnToPool(size_t sizeClass, void* block) {
+	auto& pool = _pools[sizeClass];
+	std::lock_guard<std::mutex> lock(pool.mutex);
+	*reinterpret_cast<void**>(block) = pool.freeList;
+	pool.freeList = block;
+}
+
+void* VKAPI_PTR HostAllocator::AllocationCallback(void* userData, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+	return static_cast<HostAllocator*>(userData)->Allocate(size, alignment, scope);
+}
+
+void* VKAPI_PTR HostAllocator::ReallocationCallback(void* userData, void* original, size_t size, size_t alignment, VkSystemAllocationScope scope) {
+	return static_cast<HostAllocator*>(userData)->Reallocate(original, size, alignment, scope);
+}
+
+void VKAPI_PTR HostAllocator::FreeCallback(void* userData, void* memory) {
+	static_cast<HostAllocator*>(userData)->Free(memory);
+}
+
+// The driver allocated this itself, typically executable memory for shaders. Only counted.
+void VKAPI_PTR HostAllocator::InternalAllocationCallback(void* userData, size_t size, VkInternalAllocationType, VkSystemAllocationScope) {
+	auto* allocator = static_cast<HostAllocator*>(userData);
+	allocator->_internalCalls.fetch_add(1, std::memory_order_relaxed);
+	allocator->_internalBytes.fetch_add(size, std::memory_order_relaxed);
+}
+
+void VKAPI_PTR HostAllocator::InternalFreeCallback(void* userData, size_t size, VkInternalAllocationType, VkSystemAllocationScope) {
+	static_cast<HostAllocator*>(userData)->_internalBytes.fetch_sub(size, std::memory_order_relaxed);
+}
@@ -0,0 +1,84 @@
+// HostAllocator.h : VkAllocationCallbacks that pool driver host allocations and count them per scope
+//
+// Command scope allocations only live for the duration of one Vulkan call, so they come from a per thread
+// arena that rewinds once everything in it has been freed. Longer lived allocations come from size class
+// pools, and anything bigger than the largest class (or more aligned than a block) goes to the CRT heap.
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+#include <vulkan/vulkan.hpp>
+
+class HostAllocator {
+public:
+	static constexpr size_t SCOPE_COUNT = VK_SYSTEM_ALLOCATION_SCOPE_INSTANCE + 1;
+
+	// Totals since the allocator was created. Calls are allocations and reallocations, frees are separate.
+	struct Counters {
+		std::array<uint64_t, SCOPE_COUNT> calls = {};
+		std::array<uint64_t, SCOPE_COUNT> bytes = {};
+		std::array<int64_t, SCOPE_COUNT> liveBytes = {};
+		uint64_t frees = 0;
+		uint64_t arenaOverflows = 0;
+		uint64_t heapCalls = 0;
+		uint64_t internalCalls = 0;
+		uint64_t internalBytes = 0;
+
+		uint64_t TotalCalls() const;
+		// Activity between an earlier snapshot and this one
+		Counters Since(const Counters& earlier) const;
+	};
+
+	HostAllocator();
+	~HostAllocator();
+	HostAllocator(const HostAllocator&) = delete;
+	HostAllocator& operator=(const HostAllocator&) = delete;
+
+	// Pass to every create and the matching destroy call
+	const vk::AllocationCallbacks* Callbacks() const {
+		return reinterpret_cast<const vk::AllocationCallbacks*>(&_callbacks);
+	}
+
+	Counters Snapshot() const;
+	static void Print(std::ostream& out, const Counters& counters);
+
+private:
+	// Block sizes of the pools, each a multiple of the slab alignment
+	static constexpr std::array<size_t, 7> SIZE_CLASSES = { 64, 128, 256, 512, 1024, 2048, 4096 };
+	static constexpr size_t SLAB_SIZE = 64 * 1024;
+	static constexpr size_t BLOCK_ALIGNMENT = 64;
+
+	struct Pool {
+		std::mutex mutex;
+		void* freeList = nullptr;
+		std::vector<void*> slabs;
+	};
+
+	void* Allocate(size_t size, size_t alignment, VkSystemAllocationScope scope);
+	void* Reallocate(void* original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+	void Free(void* memory);
+	void* AllocateFromPool(size_t sizeClass);
+	void ReturnToPool(size_t sizeClass, void* block);
+
+	static void* VKAPI_PTR AllocationCallback(void* userData, size_t size, size_t alignment, VkSystemAllocationScope scope);
+	static void* VKAPI_PTR ReallocationCallback(void* userData, void* original, size_t size, size_t alignment, VkSystemAllocationScope scope);
+	static void VKAPI_PTR FreeCallback(void* userData, void* memory);
+	static void VKAPI_PTR InternalAllocationCallback(void* userData, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+	static void VKAPI_PTR InternalFreeCallback(void* userData, size_t size, VkInternalAllocationType type, VkSystemAllocationScope scope);
+
+	VkAllocationCallbacks _callbacks = {};
+	std::array<Pool, SIZE_CLASSES.size()> _pools;
+	std::array<std::atomic<uint64_t>, SCOPE_COUNT> _calls;
+	std::array<std::atomic<uint64_t>, SCOPE_COUNT> _bytes;
+	std::array<std::atomic<int64_t>, SCOPE_COUNT> _liveBytes;
+	std::atomic<uint64_t> _frees = 0;
+	std::atomic<uint64_t> _arenaOverflows = 0;
+	std::atomic<uint64_t> _heapCalls = 0;
+	std::atomic<uint64_t> _internalCalls = 0;
+	std::atomic<uint64_t> _internalBytes = 0;
+};
@@ -0,0 +1,133 @@
+// MeshFormat.h : Binary mesh container shared by the sample and MeshConverter
+//
+// The file is laid out so it can be copied into a staging buffer as is:
+//
+//   MeshHeader | PackedVertex[vertexCount] | index[indexCount]
+//
+// Every section starts at a MESH_ALIGNMENT boundary. Attributes are quantized so a vertex is 16 bytes
+// instead of the 32 bytes needed for float position, normal and UV.
+
+#pragma once
+
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+
+constexpr uint32_t MESH_MAGIC = 0x484D5356; // "VSMH"
+constexpr uint32_t MESH_VERSION = 1;
+constexpr uint32_t MESH_ALIGNMENT = 16;
+
+struct MeshHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	// Size of one index in bytes, 2 or 4
+	uint32_t indexSize;
+	// Byte offsets from the start of the file
+	uint32_t vertexOffset;
+	uint32_t indexOffset;
+	uint32_t reserved;
+	// Dequantize with value = quantized / 65535 * scale + offset
+	float positionScale[3];
+	float positionOffset[3];
+	float uvScale[2];
+	float uvOffset[2];
+	uint32_t padding[2];
+};
+static_assert(sizeof(MeshHeader) % MESH_ALIGNMENT == 0, "Header must keep the vertex data aligned");
+
+struct PackedVertex {
+	uint16_t position[4]; // unorm16 within the mesh bounds, w is padding
+	int16_t normal[2];    // snorm16 octahedral encoding
+	uint16_t uv[2];       // unorm16 within the UV bounds
+};
+static_assert(sizeof(PackedVertex) == 16, "Vertex layout must match the pipeline vertex input");
+
+inline uint32_t AlignMesh(uint32_t offset) {
+	return (offset + MESH_ALIGNMENT - 1) & ~(MESH_ALIGNMENT - 1);
+}
+
+inline uint16_t QuantizeUnorm16(float value) {
+	return (uint16_t)std::lround(std::clamp(value, 0.0f, 1.0f) * 65535.0f);
+}
+
+inline int16_t QuantizeSnorm16(float value) {
+	return (int16_t)std::lround(std::clamp(value, -1.0f, 1.0f) * 32767.0f);
+}
+
+// Map a unit vector onto the octahedron and unfold it into [-1, 1]^2.
+// Must stay in sync with OctDecode in shader.vert.
+inline void OctEncode(const float n[3], int16_t out[2]) {
+	auto l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+	if (l1 == 0.0f) {
+		out[0] = 0;
+		out[1] = 0;
+		return;
+	}
+	auto x = n[0] / l1;
+	auto y = n[1] / l1;
+	if (n[2] < 0.0f) {
+		auto ox = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		auto oy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = ox;
+		y = oy;
+	}
+	out[0] = QuantizeSnorm16(x);
+	out[1] = QuantizeSnorm16(y);
+}
+
+inline void OctDecode(const int16_t in[2], float out[3]) {
+	auto x = std::max(in[0] / 32767.0f, -1.0f);
+	auto y = std::max(in[1] / 32767.0f, -1.0f);
+	auto z = 1.0f - std::abs(x) - std::abs(y);
+	if (z < 0.0f) {
+		auto ox = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+		auto oy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+		x = ox;
+		y = oy;
+	}
+	auto length = std::sqrt(x * x + y * y + z * z);
+	out[0] = x / length;
+	out[1] = y / length;
+	out[2] = z / length;
+}
+
+// Checks that a buffer of the given size holds a complete mesh
+inline bool ValidateMesh(const MeshHeader& header, uint64_t fileSize) {
+	if (header.magic != MESH_MAGIC || header.version != MESH_VERSION) {
+		return false;
+	}
+	if (header.indexSize != 2 && header.indexSize != 4) {
+		return false;
+	}
+	// Empty buffers can't be created, and the scene pipeline draws triangle lists
+	if (header.vertexCount == 0 || header.indexCount == 0 || header.indexCount % 3 != 0) {
+		return false;
+	}
+	auto vertexEnd = (uint64_t)header.vertexOffset + (uint64_t)header.vertexCount * sizeof(PackedVertex);
+	auto indexEnd = (uint64_t)header.indexOffset + (uint64_t)header.indexCount * header.indexSize;
+	return header.vertexOffset >= sizeof(MeshHeader) && vertexEnd <= header.indexOffset && indexEnd <= fileSize;
+}
+
+// Checks that every index refers to an existing vertex, so a corrupt file can't make the GPU fetch out of bounds.
+// data must hold a mesh that passed ValidateMesh.
+inline bool ValidateMeshIndices(const MeshHeader& header, const uint8_t* data) {
+	const auto* indices = data + header.indexOffset;
+	for (uint32_t i = 0; i < header.indexCount; i++) {
+		uint32_t index;
+		if (header.indexSize == 2) {
+			uint16_t index16;
+			memcpy(&index16, indices + i * 2, sizeof(index16));
+			index = index16;
+		}
+		else {
+			memcpy(&index, indices + i * 4, sizeof(index));
+		}
+		if (index >= header.vertexCount) {
+			return false;
+		}
+	}
+	return true;
+}
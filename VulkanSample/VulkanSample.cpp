@@ -7,16 +7,47 @@
 #include <set>
 #include <filesystem>
 #include <fstream>
+#include <array>
+#include <string>
+#include <map>
+#include <deque>
+#include <tuple>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <span>
 #include "framework.h"
 #include "VulkanSample.h"
+#include "MeshFormat.h"
+#include "FrustumCulling.h"
+#include "HostAllocator.h"
 #include <vulkan/vulkan.hpp>
 
 #define MAX_LOADSTRING 100
 
+// Debug labels and object names are only wanted in builds that get inspected with a capture tool.
+// Define ENABLE_DEBUG_LABELS=1 in the project settings to keep them in a release build for profiling.
+#ifndef ENABLE_DEBUG_LABELS
+#ifdef _DEBUG
+#define ENABLE_DEBUG_LABELS 1
+#else
+#define ENABLE_DEBUG_LABELS 0
+#endif
+#endif
+
 // グローバル変数:
 HINSTANCE hInst;                                // 現在のインターフェイス
 WCHAR szTitle[MAX_LOADSTRING];                  // タイトル バーのテキスト
 WCHAR szWindowClass[MAX_LOADSTRING];            // メイン ウィンドウ クラス名
+// Host memory of every Vulkan object goes through this. A global so it outlives the instance and device.
+static HostAllocator hostAllocator;
 
 // このコード モジュールに含まれる関数の宣言を転送します:
 ATOM                MyRegisterClass(HINSTANCE hInstance);
@@ -29,6 +60,20 @@ static bool contains(std::vector<T> list, T target) {
 	return std::find(list.begin(), list.end(), target) != list.end();
 }
 
+// Runs a function when leaving the scope, also when an exception is thrown
+class ScopeExit {
+public:
+	explicit ScopeExit(std::function<void()> function) : _function(std::move(function)) {}
+	~ScopeExit() {
+		_function();
+	}
+	ScopeExit(const ScopeExit&) = delete;
+	ScopeExit& operator=(const ScopeExit&) = delete;
+
+private:
+	std::function<void()> _function;
+};
+
 static uint32_t ChooseImageCount(vk::SurfaceCapabilitiesKHR capabilities) {
 	auto imgCount = capabilities.minImageCount + 1;
 	if (capabilities.maxImageCount > 0 && imgCount > capabilities.maxImageCount) {
@@ -37,9 +82,107 @@ static uint32_t ChooseImageCount(vk::SurfaceCapabilitiesKHR capabilities) {
 	return imgCount;
 }
 
+// Thin wrapper over VK_EXT_debug_utils for naming objects and labelling command buffers and queues.
+// When ENABLE_DEBUG_LABELS is 0 every method has an empty body so calls compile away completely.
+// Objects are named through DEBUG_NAME so the names themselves aren't built either.
+class DebugLabeler {
+public:
+	using Color = std::array<float, 4>;
+
+	// enabled tells whether the instance was created with VK_EXT_debug_utils. Loaders may return
+	// entry points for extensions that weren't enabled, so they say nothing about support.
+	void Init(vk::Instance instance, vk::Device device, bool enabled) {
+#if ENABLE_DEBUG_LABELS
+		_enabled = enabled;
+		if (_enabled) {
+			_dispatch.init(instance, vkGetInstanceProcAddr, device);
+			_device = device;
+		}
+#endif
+	}
+
+#if ENABLE_DEBUG_LABELS
+	template<class T>
+	void SetName(T handle, const std::string& name) const {
+		if (!_enabled) {
+			return;
+		}
+		vk::DebugUtilsObjectNameInfoEXT info;
+		info.objectType = T::objectType;
+		info.objectHandle = (uint64_t)static_cast<typename T::CType>(handle);
+		info.pObjectName = name.c_str();
+		_device.setDebugUtilsObjectNameEXT(info, _dispatch);
+	}
+#endif
+
+	void BeginRegion(vk::CommandBuffer cb, const char* name, Color color) const {
+#if ENABLE_DEBUG_LABELS
+		if (_enabled) {
+			cb.beginDebugUtilsLabelEXT(vk::DebugUtilsLabelEXT(name, color), _dispatch);
+		}
+#endif
+	}
+
+	void EndRegion(vk::CommandBuffer cb) const {
+#if ENABLE_DEBUG_LABELS
+		if (_enabled) {
+			cb.endDebugUtilsLabelEXT(_dispatch);
+		}
+#endif
+	}
+
+	void BeginQueueRegion(vk::Queue queue, const char* name, Color color) const {
+#if ENABLE_DEBUG_LABELS
+		if (_enabled) {
+			queue.beginDebugUtilsLabelEXT(vk::DebugUtilsLabelEXT(name, color), _dispatch);
+		}
+#endif
+	}
+
+	void EndQueueRegion(vk::Queue queue) const {
+#if ENABLE_DEBUG_LABELS
+		if (_enabled) {
+			queue.endDebugUtilsLabelEXT(_dispatch);
+		}
+#endif
+	}
+
+private:
+#if ENABLE_DEBUG_LABELS
+	vk::DispatchLoaderDynamic _dispatch;
+	vk::Device _device;
+	bool _enabled = false;
+#endif
+};
+
+// Labels a command buffer region for the lifetime of the object
+class ScopedCommandLabel {
+public:
+	ScopedCommandLabel(const DebugLabeler& labeler, vk::CommandBuffer cb, const char* name, DebugLabeler::Color color = { 1.0f, 1.0f, 1.0f, 1.0f })
+		: _labeler(labeler), _cb(cb) {
+		_labeler.BeginRegion(_cb, name, color);
+	}
+	~ScopedCommandLabel() {
+		_labeler.EndRegion(_cb);
+	}
+	ScopedCommandLabel(const ScopedCommandLabel&) = delete;
+	ScopedCommandLabel& operator=(const ScopedCommandLabel&) = delete;
+
+private:
+	const DebugLabeler& _labeler;
+	vk::CommandBuffer _cb;
+};
+
+// Names an object. Without debug labels the whole call, including the name expression, expands to nothing.
+#if ENABLE_DEBUG_LABELS
+#define DEBUG_NAME(labeler, handle, name) (labeler).SetName((handle), (name))
+#else
+#define DEBUG_NAME(labeler, handle, name) ((void)0)
+#endif
 
+
+// One per frame in flight of a present target
 struct ResourcePerFrame {
-	vk::Semaphore imageAvailable;
 	vk::Semaphore renderFinished;
 	vk::Fence inFlight;
 };
@@ -83,21 +226,257 @@ struct DeviceAndIndex {
 		};
 		return details;
 	}
+
+	std::optional<uint32_t> FindMemoryType(uint32_t typeBits, vk::MemoryPropertyFlags properties) const {
+		auto memProps = device.getMemoryProperties();
+		for (uint32_t i = 0; i < memProps.memoryTypeCount; i++) {
+			if ((typeBits & (1 << i)) && (memProps.memoryTypes[i].propertyFlags & properties) == properties) {
+				return i;
+			}
+		}
+		return std::nullopt;
+	}
+
+	bool SupportsExtension(const char* name) const {
+		for (const auto& e : device.enumerateDeviceExtensionProperties()) {
+			if (std::string(e.extensionName) == name) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::optional<vk::Format> FindDepthFormat() const {
+		std::vector<vk::Format> candidates = {
+			vk::Format::eD32Sfloat,
+			vk::Format::eD32SfloatS8Uint,
+			vk::Format::eD24UnormS8Uint,
+		};
+		for (const auto& f : candidates) {
+			auto props = device.getFormatProperties(f);
+			if (props.optimalTilingFeatures & vk::FormatFeatureFlagBits::eDepthStencilAttachment) {
+				return f;
+			}
+		}
+		return std::nullopt;
+	}
+
+	vk::SampleCountFlags GetSupportedSampleCounts() const {
+		auto limits = device.getProperties().limits;
+		return limits.framebufferColorSampleCounts & limits.framebufferDepthSampleCounts;
+	}
+
+	vk::SampleCountFlagBits ChooseSampleCount(vk::SampleCountFlagBits desired) const {
+		auto supported = GetSupportedSampleCounts();
+		// Walk down from the desired count until we hit one the device supports
+		auto count = (uint32_t)desired;
+		while (count > 1 && !(supported & (vk::SampleCountFlagBits)count)) {
+			count >>= 1;
+		}
+		return (vk::SampleCountFlagBits)count;
+	}
 };
 
+// Image used as a render pass attachment.
+// Transient ones (depth, MSAA color) only live for the duration of a render pass. Their contents are never
+// stored so we back them with lazily allocated memory when available, which lets tile-based GPUs keep them on chip.
+struct AttachmentImage {
+	vk::Image image;
+	vk::DeviceMemory memory;
+	vk::ImageView view;
+	vk::DeviceSize size = 0;
+	bool lazy = false;
+
+	void Init(
+		vk::Device& device,
+		const DeviceAndIndex& targetDevice,
+		vk::Extent2D extent,
+		vk::Format format,
+		vk::SampleCountFlagBits samples,
+		vk::ImageUsageFlags usage,
+		vk::ImageAspectFlags aspect,
+		bool transient = true) {
+		vk::ImageCreateInfo ici;
+		ici.imageType = vk::ImageType::e2D;
+		ici.format = format;
+		ici.extent = vk::Extent3D(extent.width, extent.height, 1);
+		ici.mipLevels = 1;
+		ici.arrayLayers = 1;
+		ici.samples = samples;
+		ici.tiling = vk::ImageTiling::eOptimal;
+		ici.usage = transient ? usage | vk::ImageUsageFlagBits::eTransientAttachment : usage;
+		ici.sharingMode = vk::SharingMode::eExclusive;
+		ici.initialLayout = vk::ImageLayout::eUndefined;
+		image = device.createImage(ici, hostAllocator.Callbacks());
+
+		auto req = device.getImageMemoryRequirements(image);
+		std::optional<uint32_t> typeIndex;
+		if (transient) {
+			typeIndex = targetDevice.FindMemoryType(req.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal | vk::MemoryPropertyFlagBits::eLazilyAllocated);
+		}
+		lazy = typeIndex.has_value();
+		if (!lazy) {
+			// Desktop GPUs usually don't expose lazily allocated memory so we fall back to plain device memory
+			typeIndex = targetDevice.FindMemoryType(req.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal);
+		}
+		if (!typeIndex.has_value()) {
+			throw std::runtime_error("Cannot find memory type for attachment");
+		}
+		vk::MemoryAllocateInfo mai;
+		mai.allocationSize = req.size;
+		mai.memoryTypeIndex = typeIndex.value();
+		memory = device.allocateMemory(mai, hostAllocator.Callbacks());
+		device.bindImageMemory(image, memory, 0);
+		size = req.size;
+
+		vk::ImageViewCreateInfo ci;
+		ci.image = image;
+		ci.viewType = vk::ImageViewType::e2D;
+		ci.format = format;
+		ci.subresourceRange.aspectMask = aspect;
+		ci.subresourceRange.baseMipLevel = 0;
+		ci.subresourceRange.levelCount = 1;
+		ci.subresourceRange.baseArrayLayer = 0;
+		ci.subresourceRange.layerCount = 1;
+		view = device.createImageView(ci, hostAllocator.Callbacks());
+	}
+
+	// Bytes actually backed by physical memory. For lazy memory this may be far below the requirement.
+	vk::DeviceSize Committed(vk::Device& device) const {
+		return lazy ? device.getMemoryCommitment(memory) : size;
+	}
+
+	void Cleanup(vk::Device& device) {
+		device.destroyImageView(view, hostAllocator.Callbacks());
+		device.destroyImage(image, hostAllocator.Callbacks());
+		device.freeMemory(memory, hostAllocator.Callbacks());
+		*this = AttachmentImage();
+	}
+};
+
+// Print the attachment memory needed for every sample count the device supports
+// so that the cost of MSAA can be judged on the target hardware.
+static void ReportAttachmentFootprint(
+	vk::Device& device,
+	const DeviceAndIndex& targetDevice,
+	vk::Extent2D extent,
+	vk::Format colorFormat,
+	vk::Format depthFormat) {
+	auto supported = targetDevice.GetSupportedSampleCounts();
+	auto lazyAvailable = targetDevice.FindMemoryType(UINT32_MAX, vk::MemoryPropertyFlagBits::eLazilyAllocated).has_value();
+	auto requirementOf = [&](vk::Format format, vk::SampleCountFlagBits samples, vk::ImageUsageFlags usage) {
+		vk::ImageCreateInfo ici;
+		ici.imageType = vk::ImageType::e2D;
+		ici.format = format;
+		ici.extent = vk::Extent3D(extent.width, extent.height, 1);
+		ici.mipLevels = 1;
+		ici.arrayLayers = 1;
+		ici.samples = samples;
+		ici.tiling = vk::ImageTiling::eOptimal;
+		ici.usage = usage | vk::ImageUsageFlagBits::eTransientAttachment;
+		auto image = device.createImage(ici, hostAllocator.Callbacks());
+		auto size = device.getImageMemoryRequirements(image).size;
+		device.destroyImage(image, hostAllocator.Callbacks());
+		return size;
+	};
+	std::cout << "Attachment memory footprint at " << extent.width << "x" << extent.height
+		<< (lazyAvailable ? " (lazily allocated memory available)" : " (no lazily allocated memory)") << std::endl;
+	for (uint32_t count = 1; count <= 64; count <<= 1) {
+		auto samples = (vk::SampleCountFlagBits)count;
+		if (!(supported & samples)) {
+			continue;
+		}
+		auto depth = requirementOf(depthFormat, samples, vk::ImageUsageFlagBits::eDepthStencilAttachment);
+		// Single sampled rendering writes straight into the scene color target so there is no extra color image
+		vk::DeviceSize color = count > 1 ? requirementOf(colorFormat, samples, vk::ImageUsageFlagBits::eColorAttachment) : 0;
+		std::cout << "  " << count << "x: color " << color / 1024 << " KiB, depth " << depth / 1024
+			<< " KiB, total " << (color + depth) / 1024 << " KiB" << std::endl;
+	}
+}
+
+
+// Attachments the scene is rendered into. The single sampled color image is what gets blitted or read back.
+struct SceneTarget {
+	vk::Framebuffer frameBuffer;
+	AttachmentImage color;
+	AttachmentImage depth;
+	AttachmentImage multisampleColor;
+
+	void Init(
+		vk::Device& device,
+		const DeviceAndIndex& targetDevice,
+		vk::Extent2D extent,
+		vk::Format colorFormat,
+		vk::Format depthFormat,
+		vk::SampleCountFlagBits samples,
+		vk::RenderPass renderPass) {
+		color.Init(device, targetDevice, extent, colorFormat, vk::SampleCountFlagBits::e1,
+			vk::ImageUsageFlagBits::eColorAttachment | vk::ImageUsageFlagBits::eTransferSrc, vk::ImageAspectFlagBits::eColor, false);
+		depth.Init(device, targetDevice, extent, depthFormat, samples, vk::ImageUsageFlagBits::eDepthStencilAttachment, vk::ImageAspectFlagBits::eDepth);
+		if (samples != vk::SampleCountFlagBits::e1) {
+			multisampleColor.Init(device, targetDevice, extent, colorFormat, samples, vk::ImageUsageFlagBits::eColorAttachment, vk::ImageAspectFlagBits::eColor);
+		}
+
+		// Attachment order must match the render pass: color, depth, then resolve target when multisampled
+		std::vector<vk::ImageView> attachments;
+		if (samples == vk::SampleCountFlagBits::e1) {
+			attachments = { color.view, depth.view };
+		}
+		else {
+			attachments = { multisampleColor.view, depth.view, color.view };
+		}
+		vk::FramebufferCreateInfo fbci;
+		fbci.renderPass = renderPass;
+		fbci.attachmentCount = (uint32_t)attachments.size();
+		fbci.pAttachments = attachments.data();
+		fbci.width = extent.width;
+		fbci.height = extent.height;
+		fbci.layers = 1;
+		frameBuffer = device.createFramebuffer(fbci, hostAllocator.Callbacks());
+	}
+
+	// Bytes the driver actually backs the transient attachments with
+	vk::DeviceSize TransientCommitted(vk::Device& device) const {
+		auto committed = depth.Committed(device);
+		if (multisampleColor.image) {
+			committed += multisampleColor.Committed(device);
+		}
+		return committed;
+	}
 
-struct SwapchainResources {
-	vk::SwapchainKHR swapchain;
-	std::vector<vk::Framebuffer> frameBuffers;
-	std::vector<vk::ImageView> imageViews;
 	void Cleanup(vk::Device& device) {
-		for (auto& fb : frameBuffers) {
-			device.destroyFramebuffer(fb);
+		device.destroyFramebuffer(frameBuffer, hostAllocator.Callbacks());
+		if (multisampleColor.image) {
+			multisampleColor.Cleanup(device);
 		}
-		for (auto& iv : imageViews) {
-			device.destroyImageView(iv);
+		depth.Cleanup(device);
+		color.Cleanup(device);
+	}
+
+#if ENABLE_DEBUG_LABELS
+	void SetDebugNames(const DebugLabeler& labeler, const std::string& prefix) const {
+		labeler.SetName(frameBuffer, prefix + "Scene framebuffer");
+		labeler.SetName(color.image, prefix + "Scene color image");
+		labeler.SetName(color.memory, prefix + "Scene color memory");
+		labeler.SetName(depth.image, prefix + "Depth image");
+		labeler.SetName(depth.memory, prefix + "Depth memory");
+		if (multisampleColor.image) {
+			labeler.SetName(multisampleColor.image, prefix + "MSAA color image");
+			labeler.SetName(multisampleColor.memory, prefix + "MSAA color memory");
 		}
-		device.destroySwapchainKHR(swapchain);
+	}
+#endif
+};
+
+struct SwapchainResources {
+	vk::SwapchainKHR swapchain;
+	std::vector<vk::Image> images;
+	// The scene is rendered into this at up to the full extent and then scaled into the swapchain image,
+	// so the render resolution can change every frame without recreating anything.
+	SceneTarget scene;
+	void Cleanup(vk::Device& device) {
+		scene.Cleanup(device);
+		device.destroySwapchainKHR(swapchain, hostAllocator.Callbacks());
 
 	}
 	void Init(
@@ -108,6 +487,8 @@ struct SwapchainResources {
 		vk::SurfaceCapabilitiesKHR capabilities,
 		vk::PresentModeKHR targetMode,
 		vk::RenderPass renderPass,
+		vk::Format depthFormat,
+		vk::SampleCountFlagBits samples,
 		DeviceAndIndex targetDevice) {
 		vk::SwapchainCreateInfoKHR chainInfo;
 		chainInfo.surface = surface;
@@ -116,7 +497,8 @@ struct SwapchainResources {
 		chainInfo.imageColorSpace = targetFormat.colorSpace;
 		chainInfo.imageExtent = extent;
 		chainInfo.imageArrayLayers = 1;
-		chainInfo.imageUsage = vk::ImageUsageFlagBits::eColorAttachment;
+		// Swapchain images are only written by the upscaling blit
+		chainInfo.imageUsage = vk::ImageUsageFlagBits::eTransferDst;
 		std::vector<uint32_t> queueFamilyIndices = { targetDevice.graphicsIndex, targetDevice.presentIndex };
 		if (targetDevice.graphicsIndex == targetDevice.presentIndex) {
 			chainInfo.imageSharingMode = vk::SharingMode::eExclusive;
@@ -133,41 +515,21 @@ struct SwapchainResources {
 		chainInfo.presentMode = targetMode;
 		chainInfo.clipped = true;
 		chainInfo.oldSwapchain = nullptr;
-		swapchain = device.createSwapchainKHR(chainInfo);
-
-		auto swapchainImages = device.getSwapchainImagesKHR(swapchain);
-		imageViews.resize(swapchainImages.size());
-		for (size_t i = 0; i < swapchainImages.size(); i++) {
-			vk::ImageViewCreateInfo ci;
-			ci.image = swapchainImages[i];
-			ci.viewType = vk::ImageViewType::e2D;
-			ci.format = targetFormat.format;
-			ci.components.r = vk::ComponentSwizzle::eIdentity;
-			ci.components.g = vk::ComponentSwizzle::eIdentity;
-			ci.components.b = vk::ComponentSwizzle::eIdentity;
-			ci.components.a = vk::ComponentSwizzle::eIdentity;
-			ci.subresourceRange.aspectMask = vk::ImageAspectFlagBits::eColor;
-			ci.subresourceRange.baseMipLevel = 0;
-			ci.subresourceRange.levelCount = 1;
-			ci.subresourceRange.baseArrayLayer = 0;
-			ci.subresourceRange.layerCount = 1;
-			imageViews[i] = device.createImageView(ci);
-		}
-
-		frameBuffers.resize(imageViews.size());
-
-		for (size_t i = 0; i < frameBuffers.size(); i++) {
-			vk::ImageView attachments[] = { imageViews[i] };
-			vk::FramebufferCreateInfo fbci;
-			fbci.renderPass = renderPass;
-			fbci.attachmentCount = 1;
-			fbci.pAttachments = attachments;
-			fbci.width = extent.width;
-			fbci.height = extent.height;
-			fbci.layers = 1;
-			frameBuffers[i] = device.createFramebuffer(fbci);
+		swapchain = device.createSwapchainKHR(chainInfo, hostAllocator.Callbacks());
+		images = device.getSwapchainImagesKHR(swapchain);
+
+		scene.Init(device, targetDevice, extent, targetFormat.format, depthFormat, samples, renderPass);
+	}
+
+#if ENABLE_DEBUG_LABELS
+	void SetDebugNames(const DebugLabeler& labeler, const std::string& prefix) const {
+		labeler.SetName(swapchain, prefix + "Swapchain");
+		for (size_t i = 0; i < images.size(); i++) {
+			labeler.SetName(images[i], prefix + "Swapchain image " + std::to_string(i));
 		}
+		scene.SetDebugNames(labeler, prefix);
 	}
+#endif
 };
 
 static std::vector <std::string> GetInstanceLayers(std::vector<std::string>& layerCandidate) {
@@ -187,6 +549,15 @@ static std::vector <std::string> GetInstanceLayers(std::vector<std::string>& lay
 	return layersInUse;
 }
 
+// Validation in debug builds when the layer is installed
+static std::vector<std::string> GetDefaultLayers() {
+	std::vector<std::string> layerCandidate;
+#ifdef _DEBUG
+	layerCandidate.push_back("VK_LAYER_KHRONOS_validation");
+#endif
+	return GetInstanceLayers(layerCandidate);
+}
+
 static vk::Instance CreateInstance(const char* appName, std::vector<const char*>& layers, std::vector<const char*> extensions) {
 	auto extensionList = vk::enumerateInstanceExtensionProperties();
 	for (const auto& ex : extensionList) {
@@ -206,7 +577,7 @@ static vk::Instance CreateInstance(const char* appName, std::vector<const char*>
 	createInfo.ppEnabledLayerNames = layers.data();
 	createInfo.enabledExtensionCount = (uint32_t)extensions.size();
 	createInfo.ppEnabledExtensionNames = extensions.data();
-	return vk::createInstance(createInfo);
+	return vk::createInstance(createInfo, hostAllocator.Callbacks());
 }
 
 void CreateConsole() {
@@ -216,11 +587,62 @@ void CreateConsole() {
 	freopen_s(&fp, "CONOUT$", "w", stderr);
 }
 
-vk::Extent2D ChooseSwapExtent(vk::SurfaceCapabilitiesKHR capabilities) {
-	return capabilities.currentExtent;
+// Options given on the command line, e.g. "--windows 2 --headless 1 --mesh bunny.mesh" or "--batch jobs.txt"
+struct LaunchOptions {
+	uint32_t windowCount = 1;
+	uint32_t headlessCount = 0;
+	std::filesystem::path meshPath; // Empty draws the built-in triangle
+	std::filesystem::path batchPath; // Renders the listed jobs offscreen instead of opening windows
+};
+
+static LaunchOptions ParseCommandLine(LPWSTR cmdLine) {
+	LaunchOptions options;
+	std::wistringstream stream(cmdLine);
+	std::wstring arg;
+	while (stream >> arg) {
+		if (arg == L"--windows") {
+			stream >> options.windowCount;
+		}
+		else if (arg == L"--headless") {
+			stream >> options.headlessCount;
+		}
+		else if (arg == L"--mesh") {
+			std::wstring path;
+			stream >> path;
+			options.meshPath = path;
+		}
+		else if (arg == L"--batch") {
+			std::wstring path;
+			stream >> path;
+			options.batchPath = path;
+		}
+	}
+	if (options.windowCount + options.headlessCount == 0) {
+		options.windowCount = 1;
+	}
+	return options;
+}
+
+static bool InstanceExtensionAvailable(const char* name) {
+	for (const auto& ex : vk::enumerateInstanceExtensionProperties()) {
+		if (std::string(ex.extensionName) == name) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Surfaces without a window (headless) leave the extent up to us, which is signaled by UINT32_MAX
+vk::Extent2D ChooseSwapExtent(vk::SurfaceCapabilitiesKHR capabilities, vk::Extent2D fallback) {
+	if (capabilities.currentExtent.width != UINT32_MAX) {
+		return capabilities.currentExtent;
+	}
+	return vk::Extent2D(
+		std::clamp(fallback.width, capabilities.minImageExtent.width, capabilities.maxImageExtent.width),
+		std::clamp(fallback.height, capabilities.minImageExtent.height, capabilities.maxImageExtent.height));
 }
 
-std::optional<DeviceAndIndex> GetSufficientDevice(vk::Instance& instance, vk::SurfaceKHR& surface, const std::vector<const char*>& requiredExtensions) {
+std::optional<DeviceAndIndex> GetSufficientDevice(vk::Instance& instance, const std::vector<vk::SurfaceKHR>& surfaces, const std::vector<const char*>& requiredExtensions) {
 	auto devices = instance.enumeratePhysicalDevices();
 	if (devices.size() <= 0) {
 		throw std::runtime_error("Cannot find physical device");
@@ -249,8 +671,11 @@ std::optional<DeviceAndIndex> GetSufficientDevice(vk::Instance& instance, vk::Su
 			if (graphicsCapable) {
 				graphicsIndex = index;
 			}
-			// queue must support presentation
-			if (d.getSurfaceSupportKHR(index, surface)) {
+			// queue must support presentation to every surface
+			auto presentCapable = std::all_of(surfaces.begin(), surfaces.end(), [&](const vk::SurfaceKHR& surface) {
+				return d.getSurfaceSupportKHR(index, surface) == VK_TRUE;
+			});
+			if (presentCapable) {
 				presentIndex = index;
 			}
 
@@ -278,129 +703,2097 @@ std::vector<uint8_t> ReadFile(const std::filesystem::path& path) {
 	return buffer;
 }
 
+void WriteFile(const std::filesystem::path& path, const std::vector<uint8_t>& data) {
+	std::ofstream file(path.string(), std::ios::binary);
+	file.write((const char*)data.data(), data.size());
+}
+
 vk::ShaderModule CreateShaderModule(vk::Device& device, const std::vector<uint8_t>& code) {
 	vk::ShaderModuleCreateInfo shaderInfo;
 	shaderInfo.codeSize = (uint32_t)code.size();
 	shaderInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
-	return device.createShaderModule(shaderInfo);
+	return device.createShaderModule(shaderInfo, hostAllocator.Callbacks());
 }
 
-void RecordCommandBuffer(
-	vk::CommandBuffer& cb,
-	vk::RenderPass renderPass,
-	vk::Framebuffer framebuffer,
-	vk::Extent2D extent,
-	vk::Pipeline pipeline) {
-	vk::CommandBufferBeginInfo cbbi;
-	cb.begin(cbbi);
-	vk::RenderPassBeginInfo rpbi;
-	rpbi.renderPass = renderPass;
-	rpbi.framebuffer = framebuffer;
-	rpbi.renderArea.offset = vk::Offset2D(0, 0);
-	rpbi.renderArea.extent = extent;
-	rpbi.clearValueCount = 1;
-	vk::ClearValue clearColor(vk::ClearColorValue(0, 0, 0, 1));
-	rpbi.pClearValues = &clearColor;
-	cb.beginRenderPass(rpbi, vk::SubpassContents::eInline);
-	cb.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
-	cb.setViewport(0, vk::Viewport(0, 0, (float)extent.width, (float)extent.height, 0, 1));
-	cb.setScissor(0, vk::Rect2D({ 0,0 }, extent));
-	cb.draw(3, 1, 0, 0);
-	cb.endRenderPass();
-	cb.end();
+// Starts from the cache of an earlier run when there is one
+static vk::PipelineCache LoadPipelineCache(vk::Device& device, const std::filesystem::path& path) {
+	std::vector<uint8_t> cacheData;
+	if (std::filesystem::exists(path)) {
+		cacheData = ::ReadFile(path);
+	}
+	vk::PipelineCacheCreateInfo cacheInfo;
+	// The driver validates the header and ignores data from another device or driver version
+	cacheInfo.initialDataSize = cacheData.size();
+	cacheInfo.pInitialData = cacheData.data();
+	return device.createPipelineCache(cacheInfo, hostAllocator.Callbacks());
 }
 
-enum WindowState {
-	RESTORED,
-	MINIMIZED,
-	MAXIMIZED,
-};
+static void SavePipelineCache(vk::Device& device, vk::PipelineCache cache, const std::filesystem::path& path) {
+	WriteFile(path, device.getPipelineCacheData(cache));
+}
 
-class EventDetector {
-public:
-	EventDetector(uint32_t width, uint32_t height) :
-		_state(RESTORED),
-		_width(width),
-		_height(height),
-		_resized(false),
-		_resizing(false) {}
+// The mesh constants are the only input besides the vertices
+static vk::PipelineLayout CreateScenePipelineLayout(vk::Device& device) {
+	vk::PushConstantRange meshConstantRange(vk::ShaderStageFlagBits::eVertex, 0, sizeof(MeshConstants));
+	vk::PipelineLayoutCreateInfo pipelineLayoutInfo;
+	pipelineLayoutInfo.pushConstantRangeCount = 1;
+	pipelineLayoutInfo.pPushConstantRanges = &meshConstantRange;
+	return device.createPipelineLayout(pipelineLayoutInfo, hostAllocator.Callbacks());
+}
 
-	bool Resized() const {
-		return _resized;
-	}
-	vk::Extent2D Extent() const {
-		return vk::Extent2D(_width, _height);
-	}
-	bool AreaIsZero() const {
-		return _width == 0 || _height == 0;
-	}
+// Color, depth, and a single sampled resolve target when multisampled.
+// The single sampled color ends up in eTransferSrcOptimal, ready for the upscale blit or a readback.
+static vk::RenderPass CreateSceneRenderPass(vk::Device& device, vk::Format colorFormat, vk::Format depthFormat, vk::SampleCountFlagBits samples) {
+	const bool multisampled = samples != vk::SampleCountFlagBits::e1;
+	vk::AttachmentDescription colorAttachment;
+	colorAttachment.format = colorFormat;
+	colorAttachment.samples = samples;
+	colorAttachment.loadOp = vk::AttachmentLoadOp::eClear;
+	// Multisampled color is resolved at the end of the subpass so the samples themselves are never stored
+	colorAttachment.storeOp = multisampled ? vk::AttachmentStoreOp::eDontCare : vk::AttachmentStoreOp::eStore;
+	colorAttachment.stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
+	colorAttachment.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
+	colorAttachment.initialLayout = vk::ImageLayout::eUndefined;
+	colorAttachment.finalLayout = multisampled ? vk::ImageLayout::eColorAttachmentOptimal : vk::ImageLayout::eTransferSrcOptimal;
+
+	vk::AttachmentDescription depthAttachment;
+	depthAttachment.format = depthFormat;
+	depthAttachment.samples = samples;
+	depthAttachment.loadOp = vk::AttachmentLoadOp::eClear;
+	depthAttachment.storeOp = vk::AttachmentStoreOp::eDontCare;
+	depthAttachment.stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
+	depthAttachment.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
+	depthAttachment.initialLayout = vk::ImageLayout::eUndefined;
+	depthAttachment.finalLayout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
+
+	vk::AttachmentDescription resolveAttachment;
+	resolveAttachment.format = colorFormat;
+	resolveAttachment.samples = vk::SampleCountFlagBits::e1;
+	resolveAttachment.loadOp = vk::AttachmentLoadOp::eDontCare;
+	resolveAttachment.storeOp = vk::AttachmentStoreOp::eStore;
+	resolveAttachment.stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
+	resolveAttachment.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
+	resolveAttachment.initialLayout = vk::ImageLayout::eUndefined;
+	resolveAttachment.finalLayout = vk::ImageLayout::eTransferSrcOptimal;
 
-	void UpdateSize(uint32_t width, uint32_t height) {
-		if (_width == width && _height == height) {
-			// Don't need to resize
-			return;
-		}
-		_width = width;
-		_height = height;
-		_resized = true;
-	}
+	vk::AttachmentReference colorAttachmentRef;
+	colorAttachmentRef.attachment = 0;
+	colorAttachmentRef.layout = vk::ImageLayout::eColorAttachmentOptimal;
 
-	void EnterResize() {
-		_resizing = true;
-	}
+	vk::AttachmentReference depthAttachmentRef;
+	depthAttachmentRef.attachment = 1;
+	depthAttachmentRef.layout = vk::ImageLayout::eDepthStencilAttachmentOptimal;
 
-	void SetState(WindowState state) {
-		_state = state;
-	}
+	vk::AttachmentReference resolveAttachmentRef;
+	resolveAttachmentRef.attachment = 2;
+	resolveAttachmentRef.layout = vk::ImageLayout::eColorAttachmentOptimal;
 
-	void ExitResize() {
-		_resizing = false;
-	}
-	void ResetResize() {
-		_resizing = false;
-		_resized = false;
+	vk::SubpassDescription subpass;
+	subpass.pipelineBindPoint = vk::PipelineBindPoint::eGraphics;
+	subpass.colorAttachmentCount = 1;
+	subpass.pColorAttachments = &colorAttachmentRef;
+	subpass.pDepthStencilAttachment = &depthAttachmentRef;
+	subpass.pResolveAttachments = multisampled ? &resolveAttachmentRef : nullptr;
+
+	// The scene color target is shared between frames in flight, so the previous frame's writes and
+	// upscale blit or readback have to finish before we write to it again
+	vk::SubpassDependency dependency;
+	dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependency.dstSubpass = 0;
+	dependency.srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eLateFragmentTests | vk::PipelineStageFlagBits::eTransfer;
+	dependency.srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+	dependency.dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput | vk::PipelineStageFlagBits::eEarlyFragmentTests;
+	dependency.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+
+	vk::SubpassDependency upscaleDependency;
+	upscaleDependency.srcSubpass = 0;
+	upscaleDependency.dstSubpass = VK_SUBPASS_EXTERNAL;
+	upscaleDependency.srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput;
+	upscaleDependency.srcAccessMask = vk::AccessFlagBits::eColorAttachmentWrite;
+	upscaleDependency.dstStageMask = vk::PipelineStageFlagBits::eTransfer;
+	upscaleDependency.dstAccessMask = vk::AccessFlagBits::eTransferRead;
+	vk::SubpassDependency dependencies[] = { dependency, upscaleDependency };
+
+	std::vector<vk::AttachmentDescription> attachments = { colorAttachment, depthAttachment };
+	if (multisampled) {
+		attachments.push_back(resolveAttachment);
 	}
+	vk::RenderPassCreateInfo renderPassInfo;
+	renderPassInfo.attachmentCount = (uint32_t)attachments.size();
+	renderPassInfo.pAttachments = attachments.data();
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+	renderPassInfo.dependencyCount = 2;
+	renderPassInfo.pDependencies = dependencies;
+	return device.createRenderPass(renderPassInfo, hostAllocator.Callbacks());
+}
 
-private:
-	WindowState _state;
-	bool _resizing;
-	bool _resized;
-	uint32_t _width;
-	uint32_t _height;
+// Fixed function state and shader stages of the scene pipeline. Shared by the monolithic pipeline and the
+// pipeline library parts, which each take the subset they own. Points into itself, so it can't be copied.
+struct ScenePipelineState {
+	vk::PipelineShaderStageCreateInfo vertexStage;
+	vk::PipelineShaderStageCreateInfo fragmentStage;
+	vk::VertexInputBindingDescription meshBinding;
+	std::array<vk::VertexInputAttributeDescription, 3> meshAttributes;
+	vk::PipelineVertexInputStateCreateInfo vertexInput;
+	vk::PipelineInputAssemblyStateCreateInfo inputAssembly;
+	std::array<vk::DynamicState, 2> dynamicStates;
+	vk::PipelineDynamicStateCreateInfo dynamicState;
+	vk::PipelineViewportStateCreateInfo viewport;
+	vk::PipelineRasterizationStateCreateInfo rasterization;
+	vk::PipelineMultisampleStateCreateInfo multisample;
+	vk::PipelineDepthStencilStateCreateInfo depthStencil;
+	vk::PipelineColorBlendAttachmentState colorBlendAttachment;
+	vk::PipelineColorBlendStateCreateInfo colorBlend;
+
+	ScenePipelineState(vk::ShaderModule vertex, vk::ShaderModule fragment, vk::SampleCountFlagBits samples) {
+		vertexStage.stage = vk::ShaderStageFlagBits::eVertex;
+		vertexStage.module = vertex;
+		vertexStage.pName = "main";
+
+		fragmentStage.stage = vk::ShaderStageFlagBits::eFragment;
+		fragmentStage.module = fragment;
+		fragmentStage.pName = "main";
+
+		// Quantized vertex layout of MeshFormat.h
+		meshBinding = vk::VertexInputBindingDescription(0, sizeof(PackedVertex), vk::VertexInputRate::eVertex);
+		meshAttributes = {
+			vk::VertexInputAttributeDescription(0, 0, vk::Format::eR16G16B16A16Unorm, offsetof(PackedVertex, position)),
+			vk::VertexInputAttributeDescription(1, 0, vk::Format::eR16G16Snorm, offsetof(PackedVertex, normal)),
+			vk::VertexInputAttributeDescription(2, 0, vk::Format::eR16G16Unorm, offsetof(PackedVertex, uv)),
+		};
+		vertexInput.vertexBindingDescriptionCount = 1;
+		vertexInput.pVertexBindingDescriptions = &meshBinding;
+		vertexInput.vertexAttributeDescriptionCount = (uint32_t)meshAttributes.size();
+		vertexInput.pVertexAttributeDescriptions = meshAttributes.data();
+
+		inputAssembly.topology = vk::PrimitiveTopology::eTriangleList;
+		inputAssembly.primitiveRestartEnable = false;
+
+		dynamicStates = { vk::DynamicState::eViewport, vk::DynamicState::eScissor };
+		dynamicState.dynamicStateCount = (uint32_t)dynamicStates.size();
+		dynamicState.pDynamicStates = dynamicStates.data();
+		// Viewport and scissor are dynamic so only their counts are baked in
+		viewport.viewportCount = 1;
+		viewport.scissorCount = 1;
+
+		rasterization.depthClampEnable = false;
+		rasterization.rasterizerDiscardEnable = false;
+		rasterization.polygonMode = vk::PolygonMode::eFill;
+		rasterization.lineWidth = 1.0f;
+		// Meshes are counter clockwise with y up. FitToView flips y, which Vulkan's y down framebuffer
+		// undoes, so they stay counter clockwise on screen.
+		rasterization.cullMode = vk::CullModeFlagBits::eBack;
+		rasterization.frontFace = vk::FrontFace::eCounterClockwise;
+		rasterization.depthBiasClamp = false;
+
+		multisample.sampleShadingEnable = false;
+		multisample.rasterizationSamples = samples;
+
+		depthStencil.depthTestEnable = true;
+		depthStencil.depthWriteEnable = true;
+		depthStencil.depthCompareOp = vk::CompareOp::eLess;
+		depthStencil.depthBoundsTestEnable = false;
+		depthStencil.stencilTestEnable = false;
+
+		colorBlendAttachment.colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
+		colorBlendAttachment.blendEnable = false;
+
+		colorBlend.logicOp = vk::LogicOp::eCopy;
+		colorBlend.logicOpEnable = false;
+		colorBlend.attachmentCount = 1;
+		colorBlend.pAttachments = &colorBlendAttachment;
+	}
+	ScenePipelineState(const ScenePipelineState&) = delete;
+	ScenePipelineState& operator=(const ScenePipelineState&) = delete;
 };
 
-int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
-	_In_opt_ HINSTANCE hPrevInstance,
-	_In_ LPWSTR    lpCmdLine,
-	_In_ int       nCmdShow)
-{
-	UNREFERENCED_PARAMETER(hPrevInstance);
-	UNREFERENCED_PARAMETER(lpCmdLine);
+// Used when the device has no VK_EXT_graphics_pipeline_library, and by batch mode where a hitch doesn't matter
+static vk::ResultValue<vk::Pipeline> CreateScenePipeline(
+	vk::Device& device,
+	vk::PipelineCache pipelineCache,
+	vk::RenderPass renderPass,
+	vk::PipelineLayout pipelineLayout,
+	vk::ShaderModule vertex,
+	vk::ShaderModule fragment,
+	vk::SampleCountFlagBits samples) {
+	ScenePipelineState state(vertex, fragment, samples);
+	vk::PipelineShaderStageCreateInfo stages[] = { state.vertexStage, state.fragmentStage };
 
-	CreateConsole();
+	vk::GraphicsPipelineCreateInfo pipelineInfo;
+	pipelineInfo.stageCount = 2;
+	pipelineInfo.pStages = stages;
+	pipelineInfo.pVertexInputState = &state.vertexInput;
+	pipelineInfo.pInputAssemblyState = &state.inputAssembly;
+	pipelineInfo.pViewportState = &state.viewport;
+	pipelineInfo.pRasterizationState = &state.rasterization;
+	pipelineInfo.pMultisampleState = &state.multisample;
+	pipelineInfo.pDepthStencilState = &state.depthStencil;
+	pipelineInfo.pColorBlendState = &state.colorBlend;
+	pipelineInfo.pDynamicState = &state.dynamicState;
+	pipelineInfo.layout = pipelineLayout;
+	pipelineInfo.renderPass = renderPass;
+	pipelineInfo.subpass = 0;
 
-	// グローバル文字列を初期化する
-	LoadStringW(hInstance, IDS_APP_TITLE, szTitle, MAX_LOADSTRING);
-	LoadStringW(hInstance, IDC_VULKANSAMPLE, szWindowClass, MAX_LOADSTRING);
-	MyRegisterClass(hInstance);
+	return device.createGraphicsPipeline(pipelineCache, pipelineInfo, hostAllocator.Callbacks());
+}
+
+// One VK_EXT_graphics_pipeline_library part of the scene pipeline with only the state that part owns.
+// Link time optimization info is retained so an optimized link can match the monolithic pipeline.
+static vk::ResultValue<vk::Pipeline> CreateScenePipelinePart(
+	vk::Device& device,
+	vk::PipelineCache pipelineCache,
+	vk::RenderPass renderPass,
+	vk::PipelineLayout pipelineLayout,
+	const ScenePipelineState& state,
+	vk::GraphicsPipelineLibraryFlagBitsEXT part) {
+	vk::GraphicsPipelineLibraryCreateInfoEXT libraryInfo;
+	libraryInfo.flags = part;
+	vk::GraphicsPipelineCreateInfo pipelineInfo;
+	pipelineInfo.pNext = &libraryInfo;
+	pipelineInfo.flags = vk::PipelineCreateFlagBits::eLibraryKHR | vk::PipelineCreateFlagBits::eRetainLinkTimeOptimizationInfoEXT;
+	switch (part) {
+	case vk::GraphicsPipelineLibraryFlagBitsEXT::eVertexInputInterface:
+		pipelineInfo.pVertexInputState = &state.vertexInput;
+		pipelineInfo.pInputAssemblyState = &state.inputAssembly;
+		break;
+	case vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders:
+		// Viewport and scissor are pre-rasterization state, so the dynamic state goes here
+		pipelineInfo.stageCount = 1;
+		pipelineInfo.pStages = &state.vertexStage;
+		pipelineInfo.pViewportState = &state.viewport;
+		pipelineInfo.pRasterizationState = &state.rasterization;
+		pipelineInfo.pDynamicState = &state.dynamicState;
+		pipelineInfo.layout = pipelineLayout;
+		pipelineInfo.renderPass = renderPass;
+		break;
+	case vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader:
+		pipelineInfo.stageCount = 1;
+		pipelineInfo.pStages = &state.fragmentStage;
+		pipelineInfo.pMultisampleState = &state.multisample;
+		pipelineInfo.pDepthStencilState = &state.depthStencil;
+		pipelineInfo.layout = pipelineLayout;
+		pipelineInfo.renderPass = renderPass;
+		break;
+	case vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentOutputInterface:
+		pipelineInfo.pMultisampleState = &state.multisample;
+		pipelineInfo.pColorBlendState = &state.colorBlend;
+		pipelineInfo.renderPass = renderPass;
+		break;
+	}
+	pipelineInfo.subpass = 0;
+	return device.createGraphicsPipeline(pipelineCache, pipelineInfo, hostAllocator.Callbacks());
+}
+
+// What differs between scene pipelines. Each pipeline library part only depends on some of these fields,
+// so variants that agree on them share that part.
+struct ScenePipelineVariant {
+	vk::ShaderModule vertex;
+	vk::ShaderModule fragment;
+	vk::CullModeFlagBits cullMode = vk::CullModeFlagBits::eBack;
+};
+
+// Scene pipelines built from VK_EXT_graphics_pipeline_library parts. Parts are cached by the state they
+// depend on, so a new variant only compiles the parts no earlier variant needed and is otherwise just a link
+// without optimization, which takes microseconds instead of the milliseconds of a full compile.
+// Optimized links run on a background thread and replace the fast ones when done.
+class ScenePipelineLibrary {
+public:
+	static constexpr std::array<vk::GraphicsPipelineLibraryFlagBitsEXT, 4> PARTS = {
+		vk::GraphicsPipelineLibraryFlagBitsEXT::eVertexInputInterface,
+		vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders,
+		vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader,
+		vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentOutputInterface,
+	};
+
+	ScenePipelineLibrary() = default;
+	~ScenePipelineLibrary() {
+		StopOptimizer();
+	}
+	ScenePipelineLibrary(const ScenePipelineLibrary&) = delete;
+	ScenePipelineLibrary& operator=(const ScenePipelineLibrary&) = delete;
+
+	// Render pass and sample count are fixed, every variant draws into the same targets
+	void Init(
+		vk::Device& device,
+		vk::PipelineCache pipelineCache,
+		vk::RenderPass renderPass,
+		vk::PipelineLayout pipelineLayout,
+		vk::SampleCountFlagBits samples,
+		const DebugLabeler& labeler) {
+		_device = device;
+		_pipelineCache = pipelineCache;
+		_renderPass = renderPass;
+		_pipelineLayout = pipelineLayout;
+		_samples = samples;
+		_labeler = &labeler;
+		_optimizer = std::thread(&ScenePipelineLibrary::OptimizerMain, this);
+	}
+
+	// Pipeline to bind for the variant, linked on first use. Returns a null handle when creation fails.
+	// Pipelines stay alive until Cleanup for frames in flight.
+	vk::Pipeline Pipeline(const ScenePipelineVariant& variant) {
+		auto key = KeyOf(variant);
+		auto found = _variants.find(key);
+		if (found != _variants.end()) {
+			return found->second.Current();
+		}
+
+		ScenePipelineState state(variant.vertex, variant.fragment, _samples);
+		state.rasterization.cullMode = variant.cullMode;
+		Linked linked;
+		uint32_t compiled = 0;
+		auto compileStart = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < PARTS.size(); i++) {
+			linked.parts[i] = Part(i, variant, state, compiled);
+			if (!linked.parts[i]) {
+				return nullptr;
+			}
+		}
+		std::chrono::duration<double, std::milli> compileMs = std::chrono::steady_clock::now() - compileStart;
+
+		auto linkStart = std::chrono::steady_clock::now();
+		auto fast = Link(linked.parts, false);
+		std::chrono::duration<double, std::micro> linkUs = std::chrono::steady_clock::now() - linkStart;
+		if (fast.result != vk::Result::eSuccess) {
+			std::cerr << "Failed to link scene pipeline: " << fast.result << std::endl;
+			return nullptr;
+		}
+		linked.fast = fast.value;
+		_variants.emplace(key, linked);
+		std::cout << "Compiled " << compiled << " of " << PARTS.size() << " scene pipeline library parts in " << compileMs.count() << " ms, linked in " << linkUs.count() << " us" << std::endl;
+
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_pending.push_back({ key, linked.parts });
+		}
+		_queued.notify_one();
+		_outstanding++;
+		return linked.fast;
+	}
+
+	// True while optimized links are queued or running on the background thread
+	bool Optimizing() const {
+		return _outstanding > 0;
+	}
+
+	// Picks up finished optimized pipelines. Returns true when any variant's Pipeline changed.
+	bool Update() {
+		if (_outstanding == 0) {
+			return false;
+		}
+		std::vector<OptimizeJob> finished;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			finished.swap(_finished);
+		}
+		auto changed = false;
+		for (const auto& job : finished) {
+			_outstanding--;
+			if (!job.optimized) {
+				continue;
+			}
+			_variants[job.key].optimized = job.optimized;
+			std::cout << "Optimized scene pipeline linked in " << job.ms << " ms" << std::endl;
+			changed = true;
+		}
+		return changed;
+	}
+
+	void Cleanup(vk::Device& device) {
+		StopOptimizer();
+		for (const auto& job : _finished) {
+			device.destroyPipeline(job.optimized, hostAllocator.Callbacks());
+		}
+		for (const auto& [key, linked] : _variants) {
+			device.destroyPipeline(linked.optimized, hostAllocator.Callbacks());
+			device.destroyPipeline(linked.fast, hostAllocator.Callbacks());
+		}
+		for (auto& parts : _parts) {
+			for (const auto& [key, part] : parts) {
+				device.destroyPipeline(part, hostAllocator.Callbacks());
+			}
+			parts.clear();
+		}
+		_pending.clear();
+		_finished.clear();
+		_variants.clear();
+		_outstanding = 0;
+	}
+
+private:
+	using PartKey = std::pair<VkShaderModule, uint32_t>;
+	using VariantKey = std::tuple<VkShaderModule, VkShaderModule, uint32_t>;
+
+	struct Linked {
+		std::array<vk::Pipeline, PARTS.size()> parts;
+		vk::Pipeline fast;
+		vk::Pipeline optimized;
+		vk::Pipeline Current() const {
+			return optimized ? optimized : fast;
+		}
+	};
+
+	struct OptimizeJob {
+		VariantKey key;
+		std::array<vk::Pipeline, PARTS.size()> parts;
+		vk::Pipeline optimized;
+		double ms = 0.0;
+	};
+
+	static VariantKey KeyOf(const ScenePipelineVariant& variant) {
+		return { (VkShaderModule)variant.vertex, (VkShaderModule)variant.fragment, (uint32_t)variant.cullMode };
+	}
+
+	// Only the fields a part is built from go into its key. Vertex input and fragment output
+	// don't depend on the variant at all, so every variant shares them.
+	static PartKey PartKeyOf(size_t part, const ScenePipelineVariant& variant) {
+		switch (PARTS[part]) {
+		case vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders:
+			return { (VkShaderModule)variant.vertex, (uint32_t)variant.cullMode };
+		case vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader:
+			return { (VkShaderModule)variant.fragment, 0 };
+		default:
+			return { VK_NULL_HANDLE, 0 };
+		}
+	}
+
+	vk::Pipeline Part(size_t part, const ScenePipelineVariant& variant, const ScenePipelineState& state, uint32_t& compiled) {
+		auto key = PartKeyOf(part, variant);
+		auto found = _parts[part].find(key);
+		if (found != _parts[part].end()) {
+			return found->second;
+		}
+		auto created = CreateScenePipelinePart(_device, _pipelineCache, _renderPass, _pipelineLayout, state, PARTS[part]);
+		if (created.result != vk::Result::eSuccess) {
+			std::cerr << "Failed to create pipeline library part: " << created.result << std::endl;
+			return nullptr;
+		}
+		DEBUG_NAME(*_labeler, created.value, "Scene pipeline " + vk::to_string(PARTS[part]) + " library " + std::to_string(_parts[part].size()));
+		_parts[part].emplace(key, created.value);
+		compiled++;
+		return created.value;
+	}
+
+	vk::ResultValue<vk::Pipeline> Link(const std::array<vk::Pipeline, PARTS.size()>& parts, bool optimize) const {
+		vk::PipelineLibraryCreateInfoKHR libraryInfo;
+		libraryInfo.libraryCount = (uint32_t)parts.size();
+		libraryInfo.pLibraries = parts.data();
+		vk::GraphicsPipelineCreateInfo pipelineInfo;
+		pipelineInfo.pNext = &libraryInfo;
+		if (optimize) {
+			pipelineInfo.flags = vk::PipelineCreateFlagBits::eLinkTimeOptimizationEXT;
+		}
+		pipelineInfo.layout = _pipelineLayout;
+		return _device.createGraphicsPipeline(_pipelineCache, pipelineInfo, hostAllocator.Callbacks());
+	}
+
+	void OptimizerMain() {
+		for (;;) {
+			OptimizeJob job;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_queued.wait(lock, [&] { return _quit || !_pending.empty(); });
+				if (_quit) {
+					return;
+				}
+				job = _pending.front();
+				_pending.pop_front();
+			}
+			auto start = std::chrono::steady_clock::now();
+			try {
+				auto optimized = Link(job.parts, true);
+				if (optimized.result == vk::Result::eSuccess) {
+					job.optimized = optimized.value;
+				}
+			}
+			catch (const vk::SystemError& e) {
+				// The fast linked pipeline stays in use
+				std::cerr << "Failed to link optimized scene pipeline: " << e.what() << std::endl;
+			}
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			job.ms = elapsed.count();
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_finished.push_back(job);
+			}
+		}
+	}
+
+	// Unstarted optimized links are dropped, the fast ones stay valid
+	void StopOptimizer() {
+		if (!_optimizer.joinable()) {
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_queued.notify_one();
+		_optimizer.join();
+	}
+
+	vk::Device _device;
+	vk::PipelineCache _pipelineCache;
+	vk::RenderPass _renderPass;
+	vk::PipelineLayout _pipelineLayout;
+	vk::SampleCountFlagBits _samples = vk::SampleCountFlagBits::e1;
+	const DebugLabeler* _labeler = nullptr;
+	std::array<std::map<PartKey, vk::Pipeline>, PARTS.size()> _parts;
+	std::map<VariantKey, Linked> _variants;
+	// Only touched by the render thread
+	uint32_t _outstanding = 0;
+	std::mutex _mutex;
+	std::condition_variable _queued;
+	std::deque<OptimizeJob> _pending;
+	std::vector<OptimizeJob> _finished;
+	bool _quit = false;
+	std::thread _optimizer;
+};
+
+struct BufferAllocation {
+	vk::Buffer buffer;
+	vk::DeviceMemory memory;
+	vk::DeviceSize size = 0;
+	uint32_t heapIndex = 0;
+
+	void Init(
+		vk::Device& device,
+		const DeviceAndIndex& targetDevice,
+		vk::DeviceSize bufferSize,
+		vk::BufferUsageFlags usage,
+		vk::MemoryPropertyFlags properties) {
+		vk::BufferCreateInfo bci;
+		bci.size = bufferSize;
+		bci.usage = usage;
+		bci.sharingMode = vk::SharingMode::eExclusive;
+		buffer = device.createBuffer(bci, hostAllocator.Callbacks());
+		auto req = device.getBufferMemoryRequirements(buffer);
+		auto typeIndex = targetDevice.FindMemoryType(req.memoryTypeBits, properties);
+		if (!typeIndex.has_value()) {
+			throw std::runtime_error("Cannot find memory type for buffer");
+		}
+		vk::MemoryAllocateInfo mai;
+		mai.allocationSize = req.size;
+		mai.memoryTypeIndex = typeIndex.value();
+		memory = device.allocateMemory(mai, hostAllocator.Callbacks());
+		device.bindBufferMemory(buffer, memory, 0);
+		size = bufferSize;
+		heapIndex = targetDevice.device.getMemoryProperties().memoryTypes[typeIndex.value()].heapIndex;
+	}
+
+	void Cleanup(vk::Device& device) {
+		device.destroyBuffer(buffer, hostAllocator.Callbacks());
+		device.freeMemory(memory, hostAllocator.Callbacks());
+		*this = BufferAllocation();
+	}
+};
+
+// Push constants for shader.vert. The unorm vertex fetch yields [0, 1], so dequantization and the fit to view
+// transform fold into one scale and offset.
+struct MeshConstants {
+	float positionScale[4];
+	float positionOffset[4];
+	float uvScaleOffset[4];
+};
+
+// Center the mesh bounds in clip space with y flipped to Vulkan's convention and depth inside [0.3, 0.7]
+static MeshConstants FitToView(const MeshHeader& header) {
+	auto radius = std::max({ header.positionScale[0], header.positionScale[1], header.positionScale[2] }) / 2;
+	if (radius <= 0.0f) {
+		radius = 1.0f;
+	}
+	const float axisScale[3] = { 0.8f / radius, -0.8f / radius, -0.2f / radius };
+	const float axisBias[3] = { 0.0f, 0.0f, 0.5f };
+	MeshConstants constants = {};
+	for (int i = 0; i < 3; i++) {
+		auto center = header.positionOffset[i] + header.positionScale[i] / 2;
+		constants.positionScale[i] = header.positionScale[i] * axisScale[i];
+		constants.positionOffset[i] = (header.positionOffset[i] - center) * axisScale[i] + axisBias[i];
+	}
+	constants.uvScaleOffset[0] = header.uvScale[0];
+	constants.uvScaleOffset[1] = header.uvScale[1];
+	constants.uvScaleOffset[2] = header.uvOffset[0];
+	constants.uvScaleOffset[3] = header.uvOffset[1];
+	return constants;
+}
+
+struct GpuMesh {
+	BufferAllocation vertices;
+	BufferAllocation indices;
+	uint32_t indexCount = 0;
+	vk::IndexType indexType = vk::IndexType::eUint16;
+	MeshConstants constants = {};
+
+	// False while the buffers are evicted. The counts and constants stay valid.
+	bool Resident() const {
+		return (bool)vertices.buffer;
+	}
+
+	void Cleanup(vk::Device& device) {
+		vertices.Cleanup(device);
+		indices.Cleanup(device);
+	}
+};
+
+// Read only view of a whole file. Mesh files are copied to the GPU straight from this mapping.
+class MappedFile {
+public:
+	MappedFile(const std::filesystem::path& path) {
+		_file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (_file == INVALID_HANDLE_VALUE) {
+			throw std::runtime_error("Cannot open " + path.string());
+		}
+		LARGE_INTEGER size;
+		GetFileSizeEx(_file, &size);
+		_size = (size_t)size.QuadPart;
+		_mapping = CreateFileMappingW(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (_mapping == nullptr) {
+			CloseHandle(_file);
+			throw std::runtime_error("Cannot map " + path.string());
+		}
+		_data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+	~MappedFile() {
+		UnmapViewOfFile(_data);
+		CloseHandle(_mapping);
+		CloseHandle(_file);
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const uint8_t* Data() const {
+		return _data;
+	}
+	size_t Size() const {
+		return _size;
+	}
+
+private:
+	HANDLE _file;
+	HANDLE _mapping;
+	const uint8_t* _data;
+	size_t _size;
+};
+
+// Mesh drawn when no file is given on the command line, encoded the same way MeshConverter does
+static std::vector<uint8_t> BuiltinTriangleMesh() {
+	MeshHeader header = {};
+	header.magic = MESH_MAGIC;
+	header.version = MESH_VERSION;
+	header.vertexCount = 3;
+	header.indexCount = 3;
+	header.indexSize = 2;
+	header.vertexOffset = AlignMesh(sizeof(MeshHeader));
+	header.indexOffset = AlignMesh(header.vertexOffset + header.vertexCount * sizeof(PackedVertex));
+	// Counter clockwise with y up like an OBJ file
+	header.positionScale[0] = 1.0f;
+	header.positionScale[1] = 1.0f;
+	header.positionOffset[0] = -0.5f;
+	header.positionOffset[1] = -0.5f;
+	header.uvScale[0] = 1.0f;
+	header.uvScale[1] = 1.0f;
+	const float positions[3][2] = { { 0.5f, 1.0f }, { 0.0f, 0.0f }, { 1.0f, 0.0f } };
+	const float normal[3] = { 0.0f, 0.0f, 1.0f };
+
+	std::vector<uint8_t> data(header.indexOffset + header.indexCount * header.indexSize, 0);
+	memcpy(data.data(), &header, sizeof(header));
+	auto* vertices = reinterpret_cast<PackedVertex*>(data.data() + header.vertexOffset);
+	auto* indices = reinterpret_cast<uint16_t*>(data.data() + header.indexOffset);
+	for (uint16_t i = 0; i < 3; i++) {
+		vertices[i].position[0] = QuantizeUnorm16(positions[i][0]);
+		vertices[i].position[1] = QuantizeUnorm16(positions[i][1]);
+		OctEncode(normal, vertices[i].normal);
+		vertices[i].uv[0] = QuantizeUnorm16(positions[i][0]);
+		vertices[i].uv[1] = QuantizeUnorm16(positions[i][1]);
+		indices[i] = i;
+	}
+	return data;
+}
+
+// A mesh copy submitted to the GPU. The mesh may be drawn once the fence has signaled.
+struct MeshUpload {
+	GpuMesh mesh;
+	BufferAllocation staging;
+	vk::CommandBuffer commandBuffer;
+	vk::Fence fence;
+
+	bool Done(vk::Device& device) const {
+		return device.getFenceStatus(fence) == vk::Result::eSuccess;
+	}
+
+	// Frees everything used for the copy but keeps the mesh. The copy must be done.
+	void Cleanup(vk::Device& device, vk::CommandPool commandPool) {
+		if (commandBuffer) {
+			device.freeCommandBuffers(commandPool, commandBuffer);
+			commandBuffer = nullptr;
+		}
+		device.destroyFence(fence, hostAllocator.Callbacks());
+		fence = nullptr;
+		staging.Cleanup(device);
+	}
+};
+
+// Copy a mesh file into a staging buffer as is and let the GPU split it into vertex and index buffers.
+// Returns as soon as the copy is submitted.
+static MeshUpload BeginMeshUpload(
+	vk::Device& device,
+	const DeviceAndIndex& targetDevice,
+	vk::Queue queue,
+	vk::CommandPool commandPool,
+	const DebugLabeler& labeler,
+	const uint8_t* data,
+	size_t size) {
+	MeshHeader header;
+	if (size < sizeof(header)) {
+		throw std::runtime_error("Mesh file is truncated");
+	}
+	memcpy(&header, data, sizeof(header));
+	if (!ValidateMesh(header, size)) {
+		throw std::runtime_error("Invalid mesh file");
+	}
+	if (!ValidateMeshIndices(header, data)) {
+		throw std::runtime_error("Mesh file has indices past the last vertex");
+	}
+
+	MeshUpload upload;
+	bool submitted = false;
+	// Nothing has reached the GPU when a step before the submit throws
+	ScopeExit cleanup([&] {
+		if (!submitted) {
+			upload.Cleanup(device, commandPool);
+			upload.mesh.Cleanup(device);
+		}
+	});
+	upload.staging.Init(device, targetDevice, size, vk::BufferUsageFlagBits::eTransferSrc,
+		vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+	DEBUG_NAME(labeler, upload.staging.buffer, "Mesh staging buffer");
+	auto mapped = device.mapMemory(upload.staging.memory, 0, size);
+	memcpy(mapped, data, size);
+	device.unmapMemory(upload.staging.memory);
+
+	auto& mesh = upload.mesh;
+	vk::DeviceSize vertexBytes = header.vertexCount * sizeof(PackedVertex);
+	vk::DeviceSize indexBytes = (vk::DeviceSize)header.indexCount * header.indexSize;
+	mesh.vertices.Init(device, targetDevice, vertexBytes, vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst,
+		vk::MemoryPropertyFlagBits::eDeviceLocal);
+	mesh.indices.Init(device, targetDevice, indexBytes, vk::BufferUsageFlagBits::eIndexBuffer | vk::BufferUsageFlagBits::eTransferDst,
+		vk::MemoryPropertyFlagBits::eDeviceLocal);
+	DEBUG_NAME(labeler, mesh.vertices.buffer, "Mesh vertex buffer");
+	DEBUG_NAME(labeler, mesh.indices.buffer, "Mesh index buffer");
+	mesh.indexCount = header.indexCount;
+	mesh.indexType = header.indexSize == 2 ? vk::IndexType::eUint16 : vk::IndexType::eUint32;
+	mesh.constants = FitToView(header);
+
+	vk::CommandBufferAllocateInfo cbai;
+	cbai.commandPool = commandPool;
+	cbai.level = vk::CommandBufferLevel::ePrimary;
+	cbai.commandBufferCount = 1;
+	upload.commandBuffer = device.allocateCommandBuffers(cbai).front();
+	upload.fence = device.createFence(vk::FenceCreateInfo(), hostAllocator.Callbacks());
+	auto& cb = upload.commandBuffer;
+	cb.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+	cb.copyBuffer(upload.staging.buffer, mesh.vertices.buffer, vk::BufferCopy(header.vertexOffset, 0, vertexBytes));
+	cb.copyBuffer(upload.staging.buffer, mesh.indices.buffer, vk::BufferCopy(header.indexOffset, 0, indexBytes));
+	// The fence only tells the host the copy finished. Later submits that draw the mesh need the writes made visible.
+	vk::MemoryBarrier toVertexInput(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eVertexAttributeRead | vk::AccessFlagBits::eIndexRead);
+	cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, {}, toVertexInput, {}, {});
+	cb.end();
+	vk::SubmitInfo submitInfo;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &cb;
+	queue.submit(submitInfo, upload.fence);
+	submitted = true;
+	return upload;
+}
+
+// Uploads a mesh and waits for it, for startup and batch jobs where there is nothing to overlap the copy with
+static GpuMesh UploadMesh(
+	vk::Device& device,
+	const DeviceAndIndex& targetDevice,
+	vk::Queue queue,
+	vk::CommandPool commandPool,
+	const DebugLabeler& labeler,
+	const uint8_t* data,
+	size_t size) {
+	auto upload = BeginMeshUpload(device, targetDevice, queue, commandPool, labeler, data, size);
+	bool uploaded = false;
+	// A failed wait means a lost device, which runs nothing anymore, so destroying is still safe
+	ScopeExit cleanup([&] {
+		upload.Cleanup(device, commandPool);
+		if (!uploaded) {
+			upload.mesh.Cleanup(device);
+		}
+	});
+	auto waited = device.waitForFences(upload.fence, true, UINT64_MAX);
+	uploaded = true;
+	return upload.mesh;
+}
+
+struct Camera {
+	float panX = 0.0f;
+	float panY = 0.0f;
+};
+
+// Copies of the mesh laid out on a grid much larger than the view, with a camera panning across it.
+// Camera space is the clip space of FitToView, so the view projection only zooms and pans x and y.
+// Immutable after Init so the update stage and command recording can read it from different threads.
+class Scene {
+public:
+	void Init(const MeshConstants& mesh, uint32_t gridSize, float spacing) {
+		_mesh = mesh;
+		// FitToView centers the mesh at (0, 0, 0.5), and unorm positions span [0, 1] on every axis
+		auto radius = 0.5f * std::sqrt(
+			mesh.positionScale[0] * mesh.positionScale[0] +
+			mesh.positionScale[1] * mesh.positionScale[1] +
+			mesh.positionScale[2] * mesh.positionScale[2]);
+		_bounds.Clear();
+		auto half = (gridSize - 1) * spacing / 2;
+		for (uint32_t y = 0; y < gridSize; y++) {
+			for (uint32_t x = 0; x < gridSize; x++) {
+				_bounds.Add(x * spacing - half, y * spacing - half, 0.5f, radius);
+			}
+		}
+		_range = half;
+	}
+
+	Camera CameraAt(double seconds) const {
+		Camera camera;
+		camera.panX = (float)(std::sin(seconds * 0.05) * _range);
+		camera.panY = (float)(std::sin(seconds * 0.031) * _range);
+		return camera;
+	}
+
+	Frustum ViewFrustum(const Camera& camera) const {
+		float viewProjection[16] = {};
+		viewProjection[0] = ZOOM;
+		viewProjection[5] = ZOOM;
+		viewProjection[10] = 1.0f;
+		viewProjection[12] = -camera.panX * ZOOM;
+		viewProjection[13] = -camera.panY * ZOOM;
+		viewProjection[15] = 1.0f;
+		return ExtractFrustum(viewProjection);
+	}
+
+	// Push constants that draw object index at its place on the grid
+	MeshConstants ObjectConstants(uint32_t index, const Camera& camera) const {
+		auto constants = _mesh;
+		const float position[2] = { _bounds.X()[index] - camera.panX, _bounds.Y()[index] - camera.panY };
+		for (int i = 0; i < 2; i++) {
+			constants.positionScale[i] *= ZOOM;
+			constants.positionOffset[i] = (constants.positionOffset[i] + position[i]) * ZOOM;
+		}
+		return constants;
+	}
+
+	const ObjectBounds& Bounds() const {
+		return _bounds;
+	}
+
+private:
+	// About 8 objects across the view at a spacing of 2
+	static constexpr float ZOOM = 0.125f;
+
+	MeshConstants _mesh = {};
+	ObjectBounds _bounds;
+	float _range = 0.0f;
+};
+
+// Runs the scene update and culling for frame N + 1 on its own thread while frame N is recorded.
+// Results are double buffered: the render thread reads one snapshot while the other is being written.
+class UpdateStage {
+public:
+	struct Snapshot {
+		Camera camera;
+		std::vector<uint32_t> visible;
+		double cpuMs = 0.0;
+	};
+
+	UpdateStage(const Scene& scene, FrustumCuller& culler)
+		: _scene(scene)
+		, _culler(culler)
+		, _thread(&UpdateStage::ThreadMain, this) {
+	}
+	~UpdateStage() {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_quit = true;
+		}
+		_kicked.notify_one();
+		_thread.join();
+	}
+	UpdateStage(const UpdateStage&) = delete;
+	UpdateStage& operator=(const UpdateStage&) = delete;
+
+	// Start producing the next snapshot for the given scene time. Must alternate with Wait.
+	void Kick(double seconds) {
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_seconds = seconds;
+			_pending = true;
+		}
+		_kicked.notify_one();
+	}
+
+	// Block until the kicked snapshot is ready. It stays untouched until the Kick after next.
+	const Snapshot& Wait() {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_finished.wait(lock, [&] { return !_pending; });
+		auto& snapshot = _snapshots[_writeIndex];
+		_writeIndex = 1 - _writeIndex;
+		return snapshot;
+	}
+
+private:
+	void ThreadMain() {
+		for (;;) {
+			double seconds;
+			Snapshot* snapshot;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_kicked.wait(lock, [&] { return _quit || _pending; });
+				if (_quit) {
+					return;
+				}
+				seconds = _seconds;
+				snapshot = &_snapshots[_writeIndex];
+			}
+			auto start = std::chrono::steady_clock::now();
+			snapshot->camera = _scene.CameraAt(seconds);
+			auto visible = _culler.Cull(_scene.ViewFrustum(snapshot->camera), _scene.Bounds());
+			// assign keeps the capacity from earlier frames
+			snapshot->visible.assign(visible.begin(), visible.end());
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			snapshot->cpuMs = elapsed.count();
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_pending = false;
+			}
+			_finished.notify_one();
+		}
+	}
+
+	const Scene& _scene;
+	FrustumCuller& _culler;
+	std::array<Snapshot, 2> _snapshots;
+	uint32_t _writeIndex = 0;
+	std::mutex _mutex;
+	std::condition_variable _kicked;
+	std::condition_variable _finished;
+	double _seconds = 0.0;
+	bool _pending = false;
+	bool _quit = false;
+	std::thread _thread;
+};
+
+// Averages of the CPU stages over a window of frames. With the update stage overlapped the frame time
+// of a CPU bound loop tends to max(update, record) instead of their sum.
+class CpuFrameStats {
+public:
+	static constexpr uint32_t WINDOW = 600;
+
+	void Add(double updateMs, double recordMs) {
+		auto now = std::chrono::steady_clock::now();
+		if (_frames == 0) {
+			_windowStart = now;
+		}
+		_updateMs += updateMs;
+		_recordMs += recordMs;
+		_frames++;
+		_windowEnd = now;
+	}
+
+	bool Full() const {
+		return _frames >= WINDOW;
+	}
+
+	void Print(std::ostream& out) {
+		std::chrono::duration<double, std::milli> window = _windowEnd - _windowStart;
+		out << "CPU update " << _updateMs / _frames << " ms, record " << _recordMs / _frames
+			<< " ms, frame " << window.count() / (_frames - 1) << " ms" << std::endl;
+		*this = CpuFrameStats();
+	}
+
+private:
+	std::chrono::steady_clock::time_point _windowStart;
+	std::chrono::steady_clock::time_point _windowEnd;
+	double _updateMs = 0.0;
+	double _recordMs = 0.0;
+	uint32_t _frames = 0;
+};
+
+// Checks that once warmed up a frame never reaches the system heap through the Vulkan allocation callbacks
+// and never makes an allocation that outlives the call. Command scope allocations are expected every frame,
+// they come from the arena and are only reported as an average.
+class AllocationWatch {
+public:
+	// Only the first few offending frames are printed
+	static constexpr uint32_t MAX_REPORTS = 8;
+
+	AllocationWatch(const HostAllocator& allocator, uint32_t warmupFrames)
+		: _allocator(allocator)
+		, _warmupFrames(warmupFrames)
+		, _warmup(warmupFrames) {
+	}
+
+	void BeginFrame() {
+		_frameStart = _allocator.Snapshot();
+	}
+
+	void EndFrame() {
+		auto frame = _allocator.Snapshot().Since(_frameStart);
+		if (_warmup > 0) {
+			_warmup--;
+			return;
+		}
+		_frames++;
+		auto commandCalls = frame.calls[VK_SYSTEM_ALLOCATION_SCOPE_COMMAND];
+		_commandCalls += commandCalls;
+		if (frame.heapCalls == 0 && frame.TotalCalls() == commandCalls) {
+			return;
+		}
+		_regressions++;
+		if (_regressions <= MAX_REPORTS) {
+			std::cerr << "Host allocation in a steady state frame:" << std::endl;
+			HostAllocator::Print(std::cerr, frame);
+		}
+#ifdef _DEBUG
+		if (IsDebuggerPresent()) {
+			__debugbreak();
+		}
+#endif
+	}
+
+	// Resizes and evictions legitimately create objects, so warm up again afterwards
+	void Reset() {
+		_warmup = _warmupFrames;
+	}
+
+	void Print(std::ostream& out) const {
+		out << "Host allocations: " << _regressions << " of " << _frames << " steady state frames allocated, "
+			<< (_frames > 0 ? (double)_commandCalls / _frames : 0.0) << " command scope calls per frame" << std::endl;
+		HostAllocator::Print(out, _allocator.Snapshot());
+	}
+
+private:
+	const HostAllocator& _allocator;
+	uint32_t _warmupFrames;
+	uint32_t _warmup;
+	HostAllocator::Counters _frameStart;
+	uint64_t _frames = 0;
+	uint64_t _regressions = 0;
+	uint64_t _commandCalls = 0;
+};
+
+void RecordCommandBuffer(
+	vk::CommandBuffer& cb,
+	vk::RenderPass renderPass,
+	vk::Framebuffer framebuffer,
+	vk::Extent2D extent,
+	vk::Pipeline pipeline,
+	vk::PipelineLayout pipelineLayout,
+	const GpuMesh& mesh,
+	const Scene& scene,
+	const Camera& camera,
+	std::span<const uint32_t> visible,
+	const DebugLabeler& labeler) {
+	ScopedCommandLabel passLabel(labeler, cb, "Main pass", { 0.2f, 0.6f, 1.0f, 1.0f });
+	vk::RenderPassBeginInfo rpbi;
+	rpbi.renderPass = renderPass;
+	rpbi.framebuffer = framebuffer;
+	rpbi.renderArea.offset = vk::Offset2D(0, 0);
+	rpbi.renderArea.extent = extent;
+	// The resolve attachment (if any) is never cleared so two values cover both layouts
+	vk::ClearValue clearValues[] = {
+		vk::ClearColorValue(0.0f, 0.0f, 0.0f, 1.0f),
+		vk::ClearDepthStencilValue(1.0f, 0),
+	};
+	rpbi.clearValueCount = 2;
+	rpbi.pClearValues = clearValues;
+	cb.beginRenderPass(rpbi, vk::SubpassContents::eInline);
+	cb.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
+	cb.setViewport(0, vk::Viewport(0, 0, (float)extent.width, (float)extent.height, 0, 1));
+	cb.setScissor(0, vk::Rect2D({ 0,0 }, extent));
+	// A mesh without buffers leaves just the cleared targets
+	if (!mesh.Resident()) {
+		cb.endRenderPass();
+		return;
+	}
+	cb.bindVertexBuffers(0, mesh.vertices.buffer, { 0 });
+	cb.bindIndexBuffer(mesh.indices.buffer, 0, mesh.indexType);
+	// Only objects that survived frustum culling are issued
+	for (auto index : visible) {
+		cb.pushConstants<MeshConstants>(pipelineLayout, vk::ShaderStageFlagBits::eVertex, 0, scene.ObjectConstants(index, camera));
+		cb.drawIndexed(mesh.indexCount, 1, 0, 0, 0);
+	}
+	cb.endRenderPass();
+}
+
+// Stretch the rendered part of the scene color target over the whole swapchain image.
+// Without a filter the format can't be blitted, and the extents must match for a plain copy.
+void RecordUpscale(
+	vk::CommandBuffer& cb,
+	vk::Image source,
+	vk::Extent2D sourceExtent,
+	vk::Image target,
+	vk::Extent2D targetExtent,
+	std::optional<vk::Filter> filter,
+	const DebugLabeler& labeler) {
+	ScopedCommandLabel upscaleLabel(labeler, cb, "Upscale", { 0.6f, 0.2f, 1.0f, 1.0f });
+	vk::ImageSubresourceRange range(vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1);
+	vk::ImageMemoryBarrier toTransfer;
+	toTransfer.srcAccessMask = vk::AccessFlagBits::eNone;
+	toTransfer.dstAccessMask = vk::AccessFlagBits::eTransferWrite;
+	toTransfer.oldLayout = vk::ImageLayout::eUndefined;
+	toTransfer.newLayout = vk::ImageLayout::eTransferDstOptimal;
+	toTransfer.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	toTransfer.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	toTransfer.image = target;
+	toTransfer.subresourceRange = range;
+	cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eTransfer, {}, nullptr, nullptr, toTransfer);
+
+	if (filter.has_value()) {
+		vk::ImageBlit region;
+		region.srcSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+		region.srcOffsets[1] = vk::Offset3D((int32_t)sourceExtent.width, (int32_t)sourceExtent.height, 1);
+		region.dstSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+		region.dstOffsets[1] = vk::Offset3D((int32_t)targetExtent.width, (int32_t)targetExtent.height, 1);
+		cb.blitImage(source, vk::ImageLayout::eTransferSrcOptimal, target, vk::ImageLayout::eTransferDstOptimal, region, filter.value());
+	}
+	else {
+		vk::ImageCopy region;
+		region.srcSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+		region.dstSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+		region.extent = vk::Extent3D(std::min(sourceExtent.width, targetExtent.width), std::min(sourceExtent.height, targetExtent.height), 1);
+		cb.copyImage(source, vk::ImageLayout::eTransferSrcOptimal, target, vk::ImageLayout::eTransferDstOptimal, region);
+	}
+
+	vk::ImageMemoryBarrier toPresent = toTransfer;
+	toPresent.srcAccessMask = vk::AccessFlagBits::eTransferWrite;
+	toPresent.dstAccessMask = vk::AccessFlagBits::eNone;
+	toPresent.oldLayout = vk::ImageLayout::eTransferDstOptimal;
+	toPresent.newLayout = vk::ImageLayout::ePresentSrcKHR;
+	cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eBottomOfPipe, {}, nullptr, nullptr, toPresent);
+}
+
+// Measures GPU time of each frame in flight with a pair of timestamps
+class GpuTimer {
+public:
+	void Init(vk::Device& device, const DeviceAndIndex& targetDevice, uint32_t slots) {
+		auto validBits = targetDevice.device.getQueueFamilyProperties()[targetDevice.graphicsIndex].timestampValidBits;
+		_supported = validBits > 0;
+		if (!_supported) {
+			return;
+		}
+		_mask = validBits >= 64 ? UINT64_MAX : (1ull << validBits) - 1;
+		_periodNs = targetDevice.device.getProperties().limits.timestampPeriod;
+		vk::QueryPoolCreateInfo qpci;
+		qpci.queryType = vk::QueryType::eTimestamp;
+		qpci.queryCount = slots * 2;
+		_pool = device.createQueryPool(qpci, hostAllocator.Callbacks());
+		_written.assign(slots, false);
+	}
+
+	void Begin(vk::CommandBuffer& cb, uint32_t slot) {
+		if (!_supported) {
+			return;
+		}
+		cb.resetQueryPool(_pool, slot * 2, 2);
+		cb.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, _pool, slot * 2);
+	}
+
+	void End(vk::CommandBuffer& cb, uint32_t slot) {
+		if (!_supported) {
+			return;
+		}
+		cb.writeTimestamp(vk::PipelineStageFlagBits::eBottomOfPipe, _pool, slot * 2 + 1);
+		_written[slot] = true;
+	}
+
+	// Call after the slot's fence has signaled. Each recorded frame is read once, so a slot that
+	// wasn't recorded since, e.g. while the target was minimized, has no result instead of an old one.
+	std::optional<double> ResultMs(vk::Device& device, uint32_t slot) {
+		if (!_supported || !_written[slot]) {
+			return std::nullopt;
+		}
+		_written[slot] = false;
+		// Read into a fixed array. The templated overload returns a new vector every frame.
+		std::array<uint64_t, 2> timestamps;
+		auto result = device.getQueryPoolResults(_pool, slot * 2, 2, sizeof(timestamps), timestamps.data(), sizeof(uint64_t), vk::QueryResultFlagBits::e64);
+		if (result != vk::Result::eSuccess) {
+			return std::nullopt;
+		}
+		auto ticks = (timestamps[1] - timestamps[0]) & _mask;
+		return ticks * _periodNs / 1e6;
+	}
+
+	void Cleanup(vk::Device& device) {
+		if (_supported) {
+			device.destroyQueryPool(_pool, hostAllocator.Callbacks());
+		}
+	}
+
+private:
+	vk::QueryPool _pool;
+	std::vector<bool> _written;
+	uint64_t _mask = 0;
+	double _periodNs = 0.0;
+	bool _supported = false;
+};
+
+// Picks the fraction of the swapchain extent to render at from the measured GPU frame time
+class ResolutionController {
+public:
+	// Don't react to frame times within this fraction of the target, otherwise the scale oscillates
+	static constexpr double DEAD_ZONE = 0.05;
+	// Fraction of the error corrected per frame
+	static constexpr double GAIN = 0.2;
+	// Scale is snapped to steps of this size so small corrections don't shimmer
+	static constexpr double STEP = 1.0 / 32;
+
+	ResolutionController(double targetMs, double minScale, double maxScale) :
+		_targetMs(targetMs),
+		_minScale(minScale),
+		_maxScale(maxScale),
+		_scale(maxScale),
+		_smoothed(maxScale) {}
+
+	// Returns true when the scale changed
+	bool Update(double gpuMs) {
+		if (gpuMs <= 0.0 || std::abs(gpuMs - _targetMs) < _targetMs * DEAD_ZONE) {
+			return false;
+		}
+		// Cost is roughly proportional to pixel count, i.e. the square of the scale
+		auto desired = std::clamp(_smoothed * std::sqrt(_targetMs / gpuMs), _minScale, _maxScale);
+		_smoothed += (desired - _smoothed) * GAIN;
+		auto snapped = std::clamp(std::round(_smoothed / STEP) * STEP, _minScale, _maxScale);
+		if (snapped == _scale) {
+			return false;
+		}
+		_scale = snapped;
+		return true;
+	}
+
+	double Scale() const {
+		return _scale;
+	}
+
+	vk::Extent2D Apply(vk::Extent2D full) const {
+		return vk::Extent2D(
+			std::max(1u, (uint32_t)(full.width * _scale)),
+			std::max(1u, (uint32_t)(full.height * _scale)));
+	}
+
+private:
+	double _targetMs;
+	double _minScale;
+	double _maxScale;
+	double _scale;
+	double _smoothed;
+};
+
+struct HeapBudget {
+	vk::DeviceSize budget;
+	vk::DeviceSize usage;
+	bool deviceLocal;
+};
+
+// Resource that can be dropped or replaced with a smaller version when its heap runs short.
+// evict releases (part of) the resource and returns the number of bytes freed.
+struct EvictableResource {
+	uint32_t heapIndex;
+	vk::DeviceSize size;
+	int priority; // Lower priority is evicted first
+	std::function<vk::DeviceSize()> evict;
+};
+
+// Tracks per heap usage and budget and evicts registered resources before the driver starts paging.
+// Needs VK_EXT_memory_budget. Without it the driver reports no usage, and the resources registered here
+// are only a small part of what is allocated, so there is nothing reliable to compare against.
+// Eviction is then disabled and only the heap sizes are known.
+class MemoryBudget {
+public:
+	// Start evicting above EVICT_RATIO of the budget and stop once we are back under TARGET_RATIO
+	static constexpr double EVICT_RATIO = 0.9;
+	static constexpr double TARGET_RATIO = 0.8;
+
+	MemoryBudget(vk::PhysicalDevice device, bool extensionEnabled) :
+		_device(device),
+		_extensionEnabled(extensionEnabled),
+		_nextId(0) {
+		Update();
+	}
+
+	void Update() {
+		// The budget structure may only be chained when the extension is enabled
+		vk::PhysicalDeviceMemoryProperties memProps;
+		vk::PhysicalDeviceMemoryBudgetPropertiesEXT budgetProps;
+		if (_extensionEnabled) {
+			auto props = _device.getMemoryProperties2<vk::PhysicalDeviceMemoryProperties2, vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+			memProps = props.get<vk::PhysicalDeviceMemoryProperties2>().memoryProperties;
+			budgetProps = props.get<vk::PhysicalDeviceMemoryBudgetPropertiesEXT>();
+		}
+		else {
+			memProps = _device.getMemoryProperties();
+		}
+		_heaps.resize(memProps.memoryHeapCount);
+		for (uint32_t i = 0; i < memProps.memoryHeapCount; i++) {
+			auto& heap = _heaps[i];
+			heap.deviceLocal = (bool)(memProps.memoryHeaps[i].flags & vk::MemoryHeapFlagBits::eDeviceLocal);
+			if (_extensionEnabled) {
+				heap.budget = budgetProps.heapBudget[i];
+				heap.usage = budgetProps.heapUsage[i];
+			}
+			else {
+				heap.budget = memProps.memoryHeaps[i].size;
+				heap.usage = 0;
+			}
+		}
+	}
+
+	const std::vector<HeapBudget>& Heaps() const {
+		return _heaps;
+	}
+
+	// Whether usage is known, otherwise nothing is ever evicted
+	bool Enabled() const {
+		return _extensionEnabled;
+	}
+
+	// Highest usage to budget ratio over device local heaps. Always 0 when disabled.
+	double Pressure() const {
+		double pressure = 0.0;
+		for (const auto& h : _heaps) {
+			if (h.deviceLocal && h.budget > 0) {
+				pressure = std::max(pressure, (double)h.usage / h.budget);
+			}
+		}
+		return pressure;
+	}
+
+	uint64_t Register(EvictableResource resource) {
+		auto id = _nextId++;
+		_resources.emplace(id, std::move(resource));
+		return id;
+	}
+
+	void Unregister(uint64_t id) {
+		_resources.erase(id);
+	}
+
+	// Whether size more bytes keep the heap under TARGET_RATIO, so a resource brought back isn't evicted again
+	bool Fits(uint32_t heapIndex, vk::DeviceSize size) const {
+		const auto& heap = _heaps[heapIndex];
+		return heap.usage + size <= heap.budget * TARGET_RATIO;
+	}
+
+	// Evict lowest priority resources from every heap over budget. Returns the total bytes released.
+	vk::DeviceSize EvictIfNeeded() {
+		vk::DeviceSize released = 0;
+		for (uint32_t i = 0; i < (uint32_t)_heaps.size(); i++) {
+			auto& heap = _heaps[i];
+			if (heap.usage <= heap.budget * EVICT_RATIO) {
+				continue;
+			}
+			std::vector<uint64_t> candidates;
+			for (const auto& [id, r] : _resources) {
+				if (r.heapIndex == i) {
+					candidates.push_back(id);
+				}
+			}
+			std::sort(candidates.begin(), candidates.end(), [&](uint64_t a, uint64_t b) {
+				return _resources[a].priority < _resources[b].priority;
+			});
+			auto target = (vk::DeviceSize)(heap.budget * TARGET_RATIO);
+			for (auto id : candidates) {
+				if (heap.usage <= target) {
+					break;
+				}
+				auto& r = _resources[id];
+				auto freed = std::min(r.evict(), r.size);
+				r.size -= freed;
+				// Usage is only refreshed by the driver on the next Update so we account for it here
+				heap.usage -= std::min(freed, heap.usage);
+				released += freed;
+				if (r.size == 0) {
+					_resources.erase(id);
+				}
+			}
+		}
+		return released;
+	}
+
+	void Print(std::ostream& out) const {
+		for (size_t i = 0; i < _heaps.size(); i++) {
+			const auto& h = _heaps[i];
+			out << "Heap " << i << (h.deviceLocal ? " (device local)" : "") << ": ";
+			if (_extensionEnabled) {
+				out << h.usage / (1024 * 1024) << " / ";
+			}
+			out << h.budget / (1024 * 1024) << " MiB" << std::endl;
+		}
+	}
+
+private:
+	vk::PhysicalDevice _device;
+	bool _extensionEnabled;
+	std::vector<HeapBudget> _heaps;
+	std::map<uint64_t, EvictableResource> _resources;
+	uint64_t _nextId;
+};
+
+// The scene mesh as a streamable resource. Under memory pressure its buffers are dropped and the built-in
+// triangle, stretched over the same bounds, is drawn in its place. The mesh is uploaded again in the
+// background once the heap has room. Nothing here waits for the GPU after construction.
+class StreamedMesh {
+public:
+	// How long to keep the fallback after an upload failed before trying again
+	static constexpr std::chrono::seconds RETRY_INTERVAL{ 1 };
+
+	// data must stay valid until Cleanup. inFlight are the fences of every frame that may use the mesh.
+	StreamedMesh(
+		vk::Device device,
+		const DeviceAndIndex& targetDevice,
+		vk::Queue queue,
+		vk::CommandPool commandPool,
+		MemoryBudget& budget,
+		std::vector<vk::Fence> inFlight,
+		const DebugLabeler& labeler,
+		const uint8_t* data,
+		size_t size)
+		: _device(device)
+		, _targetDevice(targetDevice)
+		, _queue(queue)
+		, _commandPool(commandPool)
+		, _budget(budget)
+		, _inFlight(std::move(inFlight))
+		, _labeler(labeler)
+		, _data(data)
+		, _size(size) {
+		auto triangle = BuiltinTriangleMesh();
+		_fallback = UploadMesh(_device, _targetDevice, _queue, _commandPool, _labeler, triangle.data(), triangle.size());
+		_mesh = UploadMesh(_device, _targetDevice, _queue, _commandPool, _labeler, _data, _size);
+		Register();
+	}
+	StreamedMesh(const StreamedMesh&) = delete;
+	StreamedMesh& operator=(const StreamedMesh&) = delete;
+
+	// Mesh to draw this frame. Only valid until the next Update.
+	const GpuMesh& Mesh() const {
+		return _mesh.Resident() ? _mesh : _fallback;
+	}
+
+	// Call once per frame before recording. Destroys evicted buffers whose frames have finished and streams
+	// an evicted mesh back in when it fits. Returns true when Mesh changed.
+	bool Update() {
+		ReleaseRetired();
+		if (_upload.has_value()) {
+			if (!_upload->Done(_device)) {
+				return false;
+			}
+			_upload->Cleanup(_device, _commandPool);
+			_mesh = _upload->mesh;
+			_upload.reset();
+			Register();
+			std::cout << "Mesh streamed back in, " << _evictedBytes / 1024 << " KiB" << std::endl;
+			return true;
+		}
+		if (_mesh.Resident() || std::chrono::steady_clock::now() < _retryTime || !_budget.Fits(_heapIndex, _evictedBytes)) {
+			return false;
+		}
+		try {
+			_upload = BeginMeshUpload(_device, _targetDevice, _queue, _commandPool, _labeler, _data, _size);
+		}
+		catch (const vk::OutOfDeviceMemoryError& e) {
+			// The budget was optimistic. Keep drawing the fallback and try again later.
+			std::cerr << "Streaming the mesh back in failed: " << e.what() << std::endl;
+			_retryTime = std::chrono::steady_clock::now() + RETRY_INTERVAL;
+		}
+		catch (const vk::OutOfHostMemoryError& e) {
+			std::cerr << "Streaming the mesh back in failed: " << e.what() << std::endl;
+			_retryTime = std::chrono::steady_clock::now() + RETRY_INTERVAL;
+		}
+		return false;
+	}
+
+	// The device must be idle
+	void Cleanup() {
+		if (_mesh.Resident()) {
+			_budget.Unregister(_id);
+		}
+		if (_upload.has_value()) {
+			_upload->Cleanup(_device, _commandPool);
+			_upload->mesh.Cleanup(_device);
+			_upload.reset();
+		}
+		for (auto& retired : _retired) {
+			retired.mesh.Cleanup(_device);
+		}
+		_retired.clear();
+		_mesh.Cleanup(_device);
+		_fallback.Cleanup(_device);
+	}
+
+private:
+	// Buffers of an evicted mesh, destroyed once every frame that was in flight at eviction has finished
+	struct Retired {
+		GpuMesh mesh;
+		std::vector<vk::Fence> fences;
+	};
+
+	void Register() {
+		// Both buffers are device local, so they share a heap
+		_heapIndex = _mesh.vertices.heapIndex;
+		EvictableResource resource;
+		resource.heapIndex = _heapIndex;
+		resource.size = _mesh.vertices.size + _mesh.indices.size;
+		resource.priority = 0;
+		resource.evict = [this] { return Evict(); };
+		_id = _budget.Register(std::move(resource));
+	}
+
+	// Called by MemoryBudget, which drops the registration since everything is released. Frames still in
+	// flight may read the buffers, so they are only retired here. The bytes are counted as released right
+	// away since they are freed within MAX_FRAMES_IN_FLIGHT frames.
+	vk::DeviceSize Evict() {
+		Retired retired;
+		retired.mesh = _mesh;
+		for (auto f : _inFlight) {
+			if (_device.getFenceStatus(f) == vk::Result::eNotReady) {
+				retired.fences.push_back(f);
+			}
+		}
+		_retired.push_back(std::move(retired));
+		_evictedBytes = _mesh.vertices.size + _mesh.indices.size;
+		// The counts and constants stay for the upload that brings it back
+		_mesh.vertices = BufferAllocation();
+		_mesh.indices = BufferAllocation();
+		return _evictedBytes;
+	}
+
+	// A fence reused for a later frame only signals later, so waiting for it is never too early
+	void ReleaseRetired() {
+		for (auto it = _retired.begin(); it != _retired.end();) {
+			auto finished = std::all_of(it->fences.begin(), it->fences.end(), [&](vk::Fence f) {
+				return _device.getFenceStatus(f) == vk::Result::eSuccess;
+			});
+			if (!finished) {
+				++it;
+				continue;
+			}
+			it->mesh.Cleanup(_device);
+			it = _retired.erase(it);
+		}
+	}
+
+	vk::Device _device;
+	const DeviceAndIndex& _targetDevice;
+	vk::Queue _queue;
+	vk::CommandPool _commandPool;
+	MemoryBudget& _budget;
+	std::vector<vk::Fence> _inFlight;
+	const DebugLabeler& _labeler;
+	const uint8_t* _data;
+	size_t _size;
+	GpuMesh _mesh;
+	GpuMesh _fallback;
+	std::optional<MeshUpload> _upload;
+	std::vector<Retired> _retired;
+	std::chrono::steady_clock::time_point _retryTime;
+	uint32_t _heapIndex = 0;
+	uint64_t _id = 0;
+	vk::DeviceSize _evictedBytes = 0;
+};
+
+enum WindowState {
+	RESTORED,
+	MINIMIZED,
+	MAXIMIZED,
+};
+
+class EventDetector {
+public:
+	EventDetector(uint32_t width, uint32_t height) :
+		_state(RESTORED),
+		_width(width),
+		_height(height),
+		_resized(false),
+		_resizing(false) {}
+
+	bool Resized() const {
+		return _resized;
+	}
+	vk::Extent2D Extent() const {
+		return vk::Extent2D(_width, _height);
+	}
+	bool AreaIsZero() const {
+		return _width == 0 || _height == 0;
+	}
+
+	void UpdateSize(uint32_t width, uint32_t height) {
+		if (_width == width && _height == height) {
+			// Don't need to resize
+			return;
+		}
+		_width = width;
+		_height = height;
+		_resized = true;
+	}
 
-	// アプリケーション初期化の実行:
-	auto hwnd = InitInstance(hInstance, nCmdShow);
-	if (!hwnd.has_value())
-	{
-		std::cerr << "Failed to create window" << std::endl;
-		return FALSE;
+	void EnterResize() {
+		_resizing = true;
+	}
+
+	void SetState(WindowState state) {
+		_state = state;
+	}
+
+	void ExitResize() {
+		_resizing = false;
+	}
+	void ResetResize() {
+		_resizing = false;
+		_resized = false;
+	}
+
+private:
+	WindowState _state;
+	bool _resizing;
+	bool _resized;
+	uint32_t _width;
+	uint32_t _height;
+};
+
+// Dynamic resolution: the scene is rendered at a fraction of the swapchain extent picked from the GPU frame time
+constexpr double TARGET_GPU_FRAME_MS = 14.0;
+constexpr double MIN_RENDER_SCALE = 0.5;
+// Scene drawn by every target and batch job
+constexpr uint32_t SCENE_GRID_SIZE = 128;
+constexpr float SCENE_SPACING = 2.0f;
+constexpr auto DESIRED_SAMPLE_COUNT = vk::SampleCountFlagBits::e4;
+const std::filesystem::path PIPELINE_CACHE_PATH = "pipeline_cache.bin";
+// Headless surfaces have no window to take a size from
+const vk::Extent2D HEADLESS_EXTENT(1280, 720);
+// Frames after startup or a resize in which drivers may still be creating internal objects
+constexpr uint32_t ALLOCATION_WARMUP_FRAMES = 120;
+
+// Everything owned by a single window or headless surface. Device level objects such as the render pass,
+// pipelines, pipeline cache and command pool are shared between all targets.
+struct PresentTarget {
+	std::optional<HWND> hwnd; // Empty for headless surfaces
+	vk::SurfaceKHR surface;
+	SwapchainSupportDetails details;
+	vk::PresentModeKHR presentMode = vk::PresentModeKHR::eFifo;
+	vk::Extent2D extent;
+	SwapchainResources swapchainResources;
+	// Heap allocated so the pointer stored in the window survives the target being moved
+	std::unique_ptr<EventDetector> eventDetector;
+	// Frames in flight are counted per target, so one target waiting for vblank doesn't hold back the others
+	std::vector<vk::CommandBuffer> commandBuffers;
+	std::vector<ResourcePerFrame> frames;
+	std::vector<vk::Semaphore> imageAvailable;
+	size_t frameIndex = 0;
+	uint32_t imageIndex = 0; // Acquired for the frame being recorded
+	bool outOfDate = false;  // Acquire or present asked for a new swapchain
+	GpuTimer gpuTimer;
+	ResolutionController resolution{ TARGET_GPU_FRAME_MS, MIN_RENDER_SCALE, 1.0 };
+
+#if ENABLE_DEBUG_LABELS
+	std::string DebugPrefix(size_t index) const {
+		return (hwnd.has_value() ? "Window " : "Headless ") + std::to_string(index) + " ";
+	}
+#endif
+};
+
+// Batch mode renders many independent scenes offscreen in one process, so instance, device and pipeline
+// creation are paid once instead of once per scene.
+constexpr auto BATCH_COLOR_FORMAT = vk::Format::eR8G8B8A8Srgb;
+constexpr uint32_t BATCH_FRAMES_IN_FLIGHT = 2;
+constexpr double BATCH_FRAME_SECONDS = 1.0 / 60.0;
+
+// One line of a batch file: "mesh width height frames [output.ppm]". "-" as the mesh draws the built-in triangle.
+struct BatchJob {
+	std::filesystem::path meshPath;
+	vk::Extent2D extent;
+	uint32_t frames = 1;
+	std::filesystem::path outputPath;
+};
+
+static std::vector<BatchJob> ReadBatchFile(const std::filesystem::path& path) {
+	std::ifstream file(path);
+	if (!file) {
+		throw std::runtime_error("Cannot open " + path.string());
+	}
+	std::vector<BatchJob> jobs;
+	std::string line;
+	while (std::getline(file, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::istringstream stream(line);
+		std::string mesh;
+		BatchJob job;
+		if (!(stream >> mesh >> job.extent.width >> job.extent.height >> job.frames) ||
+			job.extent.width == 0 || job.extent.height == 0 || job.frames == 0) {
+			std::cerr << "Skipping malformed batch line: " << line << std::endl;
+			continue;
+		}
+		if (mesh != "-") {
+			job.meshPath = mesh;
+		}
+		std::string output;
+		if (stream >> output) {
+			job.outputPath = output;
+		}
+		jobs.push_back(job);
+	}
+	return jobs;
+}
+
+struct BatchResult {
+	uint32_t queueIndex = 0;
+	double queuedMs = 0.0;  // Batch start until a queue picked the job up
+	double setupMs = 0.0;   // Mesh upload and attachments
+	double renderMs = 0.0;  // Every frame plus the readback
+	double latencyMs = 0.0; // Batch start until the job finished
+	std::string error;
+};
+
+// Device level objects created once and shared by every job
+struct BatchContext {
+	vk::Device device;
+	DeviceAndIndex targetDevice;
+	vk::RenderPass renderPass;
+	vk::PipelineLayout pipelineLayout;
+	vk::Pipeline pipeline;
+	vk::Format depthFormat;
+	vk::SampleCountFlagBits samples;
+	const DebugLabeler* labeler;
+};
+
+// What one queue needs to run jobs. Each worker thread owns one so jobs never contend for a queue or pool.
+struct BatchWorker {
+	vk::Queue queue;
+	vk::CommandPool commandPool;
+	std::vector<vk::CommandBuffer> commandBuffers;
+	std::vector<vk::Fence> fences;
+	std::unique_ptr<FrustumCuller> culler;
+
+	void Init(vk::Device& device, uint32_t queueFamily, uint32_t queueIndex, const DebugLabeler& labeler) {
+		queue = device.getQueue(queueFamily, queueIndex);
+		vk::CommandPoolCreateInfo poolInfo;
+		poolInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
+		poolInfo.queueFamilyIndex = queueFamily;
+		commandPool = device.createCommandPool(poolInfo, hostAllocator.Callbacks());
+		vk::CommandBufferAllocateInfo cbai;
+		cbai.commandPool = commandPool;
+		cbai.level = vk::CommandBufferLevel::ePrimary;
+		cbai.commandBufferCount = BATCH_FRAMES_IN_FLIGHT;
+		commandBuffers = device.allocateCommandBuffers(cbai);
+		for (uint32_t i = 0; i < BATCH_FRAMES_IN_FLIGHT; i++) {
+			fences.push_back(device.createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled), hostAllocator.Callbacks()));
+		}
+		// Every worker is busy with its own job, so each culls on its own thread only
+		culler = std::make_unique<FrustumCuller>(0);
+		DEBUG_NAME(labeler, queue, "Batch queue " + std::to_string(queueIndex));
+		DEBUG_NAME(labeler, commandPool, "Batch queue " + std::to_string(queueIndex) + " command pool");
+	}
+
+	// Waits for everything submitted by the worker and leaves every fence signaled for the next job,
+	// even when a job stopped between resetting a fence and submitting with it
+	void Drain(vk::Device& device) {
+		queue.waitIdle();
+		for (auto& f : fences) {
+			if (device.getFenceStatus(f) == vk::Result::eNotReady) {
+				queue.submit(vk::SubmitInfo(), f);
+			}
+		}
+		queue.waitIdle();
+	}
+
+	void Cleanup(vk::Device& device) {
+		for (auto& f : fences) {
+			device.destroyFence(f, hostAllocator.Callbacks());
+		}
+		device.destroyCommandPool(commandPool, hostAllocator.Callbacks());
 	}
+};
+
+// Binary PPM of the RGB channels
+static void WritePpm(const std::filesystem::path& path, const uint8_t* rgba, vk::Extent2D extent) {
+	std::ofstream file(path.string(), std::ios::binary);
+	file << "P6\n" << extent.width << " " << extent.height << "\n255\n";
+	std::vector<uint8_t> row(extent.width * 3);
+	for (uint32_t y = 0; y < extent.height; y++) {
+		for (uint32_t x = 0; x < extent.width; x++) {
+			memcpy(&row[x * 3], &rgba[(y * extent.width + x) * 4], 3);
+		}
+		file.write((const char*)row.data(), row.size());
+	}
+}
+
+static void RunBatchJob(const BatchContext& context, BatchWorker& worker, const BatchJob& job, BatchResult& result) {
+	auto device = context.device;
+	auto setupStart = std::chrono::steady_clock::now();
+	GpuMesh mesh;
+	SceneTarget target;
+	BufferAllocation readback;
+	// Also runs when a step throws, so a bad job doesn't leak for the rest of the batch.
+	// Nothing is destroyed before the GPU work submitted for the job has finished.
+	ScopeExit cleanup([&] {
+		try {
+			worker.Drain(device);
+		}
+		catch (const vk::SystemError& e) {
+			// A lost device runs nothing anymore, so destroying is still safe
+			std::cerr << "Failed to drain batch queue: " << e.what() << std::endl;
+		}
+		readback.Cleanup(device);
+		target.Cleanup(device);
+		mesh.Cleanup(device);
+	});
+	if (job.meshPath.empty()) {
+		auto triangle = BuiltinTriangleMesh();
+		mesh = UploadMesh(device, context.targetDevice, worker.queue, worker.commandPool, *context.labeler, triangle.data(), triangle.size());
+	}
+	else {
+		MappedFile meshFile(job.meshPath);
+		mesh = UploadMesh(device, context.targetDevice, worker.queue, worker.commandPool, *context.labeler, meshFile.Data(), meshFile.Size());
+	}
+	target.Init(device, context.targetDevice, job.extent, BATCH_COLOR_FORMAT, context.depthFormat, context.samples, context.renderPass);
+#if ENABLE_DEBUG_LABELS
+	target.SetDebugNames(*context.labeler, "Batch " + (job.meshPath.empty() ? std::string("triangle") : job.meshPath.filename().string()) + " ");
+#endif
+	if (!job.outputPath.empty()) {
+		readback.Init(device, context.targetDevice, (vk::DeviceSize)job.extent.width * job.extent.height * 4, vk::BufferUsageFlagBits::eTransferDst,
+			vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+		DEBUG_NAME(*context.labeler, readback.buffer, "Batch readback " + job.outputPath.filename().string());
+		DEBUG_NAME(*context.labeler, readback.memory, "Batch readback memory " + job.outputPath.filename().string());
+	}
+	Scene scene;
+	scene.Init(mesh.constants, SCENE_GRID_SIZE, SCENE_SPACING);
+	auto renderStart = std::chrono::steady_clock::now();
+
+	for (uint32_t frame = 0; frame < job.frames; frame++) {
+		auto slot = frame % BATCH_FRAMES_IN_FLIGHT;
+		auto& cb = worker.commandBuffers[slot];
+		// Culling and recording of this frame overlap the GPU work of the previous one
+		auto camera = scene.CameraAt(frame * BATCH_FRAME_SECONDS);
+		auto visible = worker.culler->Cull(scene.ViewFrustum(camera), scene.Bounds());
+		auto waited = device.waitForFences(worker.fences[slot], true, UINT64_MAX);
+		device.resetFences(worker.fences[slot]);
+		cb.reset();
+		cb.begin(vk::CommandBufferBeginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit));
+		RecordCommandBuffer(cb, context.renderPass, target.frameBuffer, job.extent, context.pipeline, context.pipelineLayout, mesh, scene, camera, visible, *context.labeler);
+		if (readback.buffer && frame + 1 == job.frames) {
+			// The render pass leaves the color in eTransferSrcOptimal and orders the copy after its writes
+			vk::BufferImageCopy region;
+			region.imageSubresource = vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 0, 1);
+			region.imageExtent = vk::Extent3D(job.extent.width, job.extent.height, 1);
+			cb.copyImageToBuffer(target.color.image, vk::ImageLayout::eTransferSrcOptimal, readback.buffer, region);
+			vk::MemoryBarrier toHost(vk::AccessFlagBits::eTransferWrite, vk::AccessFlagBits::eHostRead);
+			cb.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost, {}, toHost, {}, {});
+		}
+		cb.end();
+		vk::SubmitInfo submitInfo;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &cb;
+		worker.queue.submit(submitInfo, worker.fences[slot]);
+	}
+	auto finished = device.waitForFences(worker.fences, true, UINT64_MAX);
+	if (readback.buffer) {
+		auto pixels = device.mapMemory(readback.memory, 0, readback.size);
+		WritePpm(job.outputPath, (const uint8_t*)pixels, job.extent);
+		device.unmapMemory(readback.memory);
+	}
+	auto renderEnd = std::chrono::steady_clock::now();
+
+	result.setupMs = std::chrono::duration<double, std::milli>(renderStart - setupStart).count();
+	result.renderMs = std::chrono::duration<double, std::milli>(renderEnd - renderStart).count();
+}
+
+static int RunBatch(const LaunchOptions& options, const char* appName) {
+	auto processStart = std::chrono::steady_clock::now();
+	auto jobs = ReadBatchFile(options.batchPath);
+	if (jobs.empty()) {
+		std::cerr << "No jobs in " << options.batchPath.string() << std::endl;
+		return -1;
+	}
+
+	auto layers = GetDefaultLayers();
+	std::vector<const char*> actualLayers;
+	for (auto& c : layers) {
+		actualLayers.push_back(c.c_str());
+	}
+	// No surfaces, so no surface extensions either
+	std::vector<const char*> extensions;
+	auto debugUtilsEnabled = false;
+#if ENABLE_DEBUG_LABELS
+	if (InstanceExtensionAvailable(VK_EXT_DEBUG_UTILS_EXTENSION_NAME)) {
+		extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+		debugUtilsEnabled = true;
+	}
+#endif
+	auto instance = CreateInstance(appName, actualLayers, extensions);
+	auto targetDevice = GetSufficientDevice(instance, {}, {});
+	if (!targetDevice.has_value()) {
+		std::cerr << "Could not find sufficient device" << std::endl;
+		return -1;
+	}
+
+	// Every queue of the graphics family gets a worker thread. Other families cannot run the render pass.
+	auto family = targetDevice->graphicsIndex;
+	auto familyQueues = targetDevice->device.getQueueFamilyProperties()[family].queueCount;
+	auto queueCount = std::min({ familyQueues, std::max(1u, std::thread::hardware_concurrency()), (uint32_t)jobs.size() });
+	std::vector<float> priorities(queueCount, 1.0f);
+	vk::DeviceQueueCreateInfo qinfo;
+	qinfo.queueFamilyIndex = family;
+	qinfo.queueCount = queueCount;
+	qinfo.pQueuePriorities = priorities.data();
+	vk::PhysicalDeviceFeatures deviceFeature;
+	vk::DeviceCreateInfo info;
+	info.queueCreateInfoCount = 1;
+	info.pQueueCreateInfos = &qinfo;
+	info.pEnabledFeatures = &deviceFeature;
+	info.enabledLayerCount = (uint32_t)actualLayers.size();
+	info.ppEnabledLayerNames = actualLayers.data();
+	auto device = targetDevice->device.createDevice(info, hostAllocator.Callbacks());
+	DebugLabeler labeler;
+	labeler.Init(instance, device, debugUtilsEnabled);
+
+	auto depthFormat = targetDevice->FindDepthFormat();
+	if (!depthFormat.has_value()) {
+		std::cerr << "Could not find supported depth format" << std::endl;
+		return -1;
+	}
+	BatchContext context;
+	context.device = device;
+	context.targetDevice = targetDevice.value();
+	context.depthFormat = depthFormat.value();
+	context.samples = targetDevice->ChooseSampleCount(DESIRED_SAMPLE_COUNT);
+	context.labeler = &labeler;
+
+	// One pipeline serves every job, and the cache carries it over from earlier runs
+	auto pipelineCache = LoadPipelineCache(device, PIPELINE_CACHE_PATH);
+	auto fragment = CreateShaderModule(device, ::ReadFile("fragment.spv"));
+	auto vertex = CreateShaderModule(device, ::ReadFile("vertex.spv"));
+	context.pipelineLayout = CreateScenePipelineLayout(device);
+	context.renderPass = CreateSceneRenderPass(device, BATCH_COLOR_FORMAT, context.depthFormat, context.samples);
+	auto pipeline = CreateScenePipeline(device, pipelineCache, context.renderPass, context.pipelineLayout, vertex, fragment, context.samples);
+	if (pipeline.result != vk::Result::eSuccess) {
+		std::cerr << "Failed to create graphics pipeline: " << pipeline.result << std::endl;
+		return -1;
+	}
+	context.pipeline = pipeline.value;
+	DEBUG_NAME(labeler, context.pipeline, "Batch pipeline");
+
+	std::vector<BatchWorker> workers(queueCount);
+	for (uint32_t i = 0; i < queueCount; i++) {
+		workers[i].Init(device, family, i, labeler);
+	}
+	auto batchStart = std::chrono::steady_clock::now();
+	std::cout << "Setup took " << std::chrono::duration<double, std::milli>(batchStart - processStart).count() << " ms, running "
+		<< jobs.size() << " jobs on " << queueCount << " queues with " << (uint32_t)context.samples << "x MSAA" << std::endl;
+
+	// Workers pull the next job as soon as they are free, so long jobs don't hold up the rest
+	std::vector<BatchResult> results(jobs.size());
+	std::atomic<size_t> nextJob = 0;
+	std::vector<std::thread> threads;
+	for (uint32_t i = 0; i < queueCount; i++) {
+		threads.emplace_back([&, i] {
+			for (auto j = nextJob++; j < jobs.size(); j = nextJob++) {
+				auto& result = results[j];
+				result.queueIndex = i;
+				result.queuedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batchStart).count();
+				try {
+					RunBatchJob(context, workers[i], jobs[j], result);
+				}
+				catch (const std::exception& e) {
+					result.error = e.what();
+				}
+				result.latencyMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - batchStart).count();
+			}
+		});
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	std::chrono::duration<double> batchSeconds = std::chrono::steady_clock::now() - batchStart;
+
+	uint64_t frames = 0;
+	size_t failed = 0;
+	double maxLatencyMs = 0.0;
+	for (size_t j = 0; j < jobs.size(); j++) {
+		const auto& job = jobs[j];
+		const auto& result = results[j];
+		std::cout << "Job " << j << " (" << (job.meshPath.empty() ? "triangle" : job.meshPath.string()) << " "
+			<< job.extent.width << "x" << job.extent.height << " x" << job.frames << ") on queue " << result.queueIndex;
+		if (!result.error.empty()) {
+			std::cout << " failed: " << result.error << std::endl;
+			failed++;
+			continue;
+		}
+		std::cout << ": queued " << result.queuedMs << " ms, setup " << result.setupMs << " ms, render " << result.renderMs
+			<< " ms, latency " << result.latencyMs << " ms" << std::endl;
+		frames += job.frames;
+		maxLatencyMs = std::max(maxLatencyMs, result.latencyMs);
+	}
+	auto succeeded = jobs.size() - failed;
+	std::cout << succeeded << " jobs and " << frames << " frames in " << batchSeconds.count() << " s: "
+		<< succeeded / batchSeconds.count() << " jobs/s, " << frames / batchSeconds.count() << " frames/s, max latency "
+		<< maxLatencyMs << " ms" << std::endl;
+
+	for (auto& w : workers) {
+		w.Cleanup(device);
+	}
+	device.destroyPipeline(context.pipeline, hostAllocator.Callbacks());
+	SavePipelineCache(device, pipelineCache, PIPELINE_CACHE_PATH);
+	device.destroyPipelineCache(pipelineCache, hostAllocator.Callbacks());
+	device.destroyRenderPass(context.renderPass, hostAllocator.Callbacks());
+	device.destroyPipelineLayout(context.pipelineLayout, hostAllocator.Callbacks());
+	device.destroyShaderModule(fragment, hostAllocator.Callbacks());
+	device.destroyShaderModule(vertex, hostAllocator.Callbacks());
+	device.destroy(hostAllocator.Callbacks());
+	instance.destroy(hostAllocator.Callbacks());
+	return failed == 0 ? 0 : 1;
+}
+
+int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
+	_In_opt_ HINSTANCE hPrevInstance,
+	_In_ LPWSTR    lpCmdLine,
+	_In_ int       nCmdShow)
+{
+	UNREFERENCED_PARAMETER(hPrevInstance);
+
+	CreateConsole();
+
+	// グローバル文字列を初期化する
+	LoadStringW(hInstance, IDS_APP_TITLE, szTitle, MAX_LOADSTRING);
+	LoadStringW(hInstance, IDC_VULKANSAMPLE, szWindowClass, MAX_LOADSTRING);
+	MyRegisterClass(hInstance);
+
+	auto options = ParseCommandLine(lpCmdLine);
 	constexpr size_t TITLE_SIZE = MAX_LOADSTRING * sizeof(WCHAR);
 	char windowTitle[TITLE_SIZE];
 	size_t size;
 	wcstombs_s(&size, windowTitle, TITLE_SIZE, szTitle, MAX_LOADSTRING - 1);
+	if (!options.batchPath.empty()) {
+		return RunBatch(options, windowTitle);
+	}
 
-	std::vector<std::string> layerCandidate;
-#ifdef _DEBUG
-	layerCandidate.push_back("VK_LAYER_KHRONOS_validation");
-#endif
-	auto layers = GetInstanceLayers(layerCandidate);
+	// アプリケーション初期化の実行:
+	std::vector<HWND> windows;
+	for (uint32_t i = 0; i < options.windowCount; i++) {
+		auto hwnd = InitInstance(hInstance, nCmdShow);
+		if (!hwnd.has_value())
+		{
+			std::cerr << "Failed to create window" << std::endl;
+			return FALSE;
+		}
+		windows.push_back(hwnd.value());
+	}
+
+	auto layers = GetDefaultLayers();
 	std::vector<const char*> actualLayers;
 	actualLayers.reserve(layers.size());
 	for (auto& c : layers) {
@@ -410,17 +2803,52 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 		VK_KHR_SURFACE_EXTENSION_NAME,
 		VK_KHR_WIN32_SURFACE_EXTENSION_NAME,
 	};
+	auto debugUtilsEnabled = false;
+#if ENABLE_DEBUG_LABELS
+	if (InstanceExtensionAvailable(VK_EXT_DEBUG_UTILS_EXTENSION_NAME)) {
+		extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
+		debugUtilsEnabled = true;
+	}
+#endif
+	auto headlessCount = options.headlessCount;
+	if (headlessCount > 0) {
+		if (InstanceExtensionAvailable(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME)) {
+			extensions.push_back(VK_EXT_HEADLESS_SURFACE_EXTENSION_NAME);
+		}
+		else {
+			std::cerr << "VK_EXT_headless_surface is unavailable, skipping headless surfaces" << std::endl;
+			headlessCount = 0;
+		}
+	}
+	if (windows.empty() && headlessCount == 0) {
+		std::cerr << "Nothing to render to" << std::endl;
+		return FALSE;
+	}
 	auto instance = CreateInstance(windowTitle, actualLayers, extensions);
 
-	vk::Win32SurfaceCreateInfoKHR win32info;
-	win32info.hwnd = hwnd.value();
-	win32info.hinstance = hInstance;
-	auto surface = instance.createWin32SurfaceKHR(win32info);
+	std::vector<PresentTarget> targets(windows.size() + headlessCount);
+	for (size_t i = 0; i < windows.size(); i++) {
+		vk::Win32SurfaceCreateInfoKHR win32info;
+		win32info.hwnd = windows[i];
+		win32info.hinstance = hInstance;
+		targets[i].hwnd = windows[i];
+		targets[i].surface = instance.createWin32SurfaceKHR(win32info, hostAllocator.Callbacks());
+	}
+	if (headlessCount > 0) {
+		vk::DispatchLoaderDynamic headlessDispatch(instance, vkGetInstanceProcAddr);
+		for (size_t i = windows.size(); i < targets.size(); i++) {
+			targets[i].surface = instance.createHeadlessSurfaceEXT(vk::HeadlessSurfaceCreateInfoEXT(), hostAllocator.Callbacks(), headlessDispatch);
+		}
+	}
+	std::vector<vk::SurfaceKHR> surfaces;
+	for (const auto& t : targets) {
+		surfaces.push_back(t.surface);
+	}
 
 	std::vector<const char*> deviceExtensions = {
 		VK_KHR_SWAPCHAIN_EXTENSION_NAME,
 	};
-	auto targetDevice = GetSufficientDevice(instance, surface, deviceExtensions);
+	auto targetDevice = GetSufficientDevice(instance, surfaces, deviceExtensions);
 	if (!targetDevice.has_value()) {
 		std::cerr << "Could not find sufficient device" << std::endl;
 		return false;
@@ -428,15 +2856,47 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
 	float priority = 1.0f;
 	auto qInfoList = targetDevice->GetQueueCreateInfoList(&priority);
-	auto details = targetDevice->GetSwapchainSupportDetails(surface);
 	auto targetFormat = vk::SurfaceFormatKHR(vk::Format::eB8G8R8A8Srgb, vk::ColorSpaceKHR::eSrgbNonlinear);
-	auto targetMode = vk::PresentModeKHR::eFifo;
-	if (!details.SwapchainAdequate(targetFormat, targetMode)) {
-		std::cerr << "Could not find sufficient swap chain" << std::endl;
-		return false;
+	for (auto& t : targets) {
+		t.details = targetDevice->GetSwapchainSupportDetails(t.surface);
+		if (!t.details.SwapchainAdequate(targetFormat, vk::PresentModeKHR::eFifo)) {
+			std::cerr << "Could not find sufficient swap chain" << std::endl;
+			return false;
+		}
+		if (!(t.details.capabilities.supportedUsageFlags & vk::ImageUsageFlagBits::eTransferDst)) {
+			std::cerr << "Swap chain images cannot be blitted to" << std::endl;
+			return false;
+		}
+		// Only the first target is paced by vblank. The others use mailbox when they can, so they
+		// show their newest frame instead of queueing behind their display's vblank.
+		auto mailbox = contains(t.details.presentModes, vk::PresentModeKHR::eMailbox);
+		t.presentMode = (&t != &targets.front() && mailbox) ? vk::PresentModeKHR::eMailbox : vk::PresentModeKHR::eFifo;
+		t.extent = ChooseSwapExtent(t.details.capabilities, HEADLESS_EXTENT);
+	}
+	// Optional extensions are enabled only when the chosen device has them
+	auto memoryBudgetSupported = targetDevice->SupportsExtension(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+	if (memoryBudgetSupported) {
+		deviceExtensions.push_back(VK_EXT_MEMORY_BUDGET_EXTENSION_NAME);
+	}
+	auto pipelineLibrarySupported = targetDevice->SupportsExtension(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME)
+		&& targetDevice->SupportsExtension(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME)
+		&& targetDevice->device.getFeatures2<vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>()
+			.get<vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT>().graphicsPipelineLibrary;
+	// Without fast linking an unoptimized link may cost as much as a full compile, so libraries gain nothing
+	if (pipelineLibrarySupported && !targetDevice->device.getProperties2<vk::PhysicalDeviceProperties2, vk::PhysicalDeviceGraphicsPipelineLibraryPropertiesEXT>()
+		.get<vk::PhysicalDeviceGraphicsPipelineLibraryPropertiesEXT>().graphicsPipelineLibraryFastLinking) {
+		std::cout << "VK_EXT_graphics_pipeline_library has no fast linking on this device" << std::endl;
+		pipelineLibrarySupported = false;
+	}
+	vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT pipelineLibraryFeatures;
+	pipelineLibraryFeatures.graphicsPipelineLibrary = true;
+	if (pipelineLibrarySupported) {
+		deviceExtensions.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+		deviceExtensions.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
 	}
 	vk::PhysicalDeviceFeatures deviceFeature;
 	vk::DeviceCreateInfo info;
+	info.pNext = pipelineLibrarySupported ? &pipelineLibraryFeatures : nullptr;
 	info.pQueueCreateInfos = qInfoList.data();
 	info.queueCreateInfoCount = (uint32_t)qInfoList.size();
 	info.pEnabledFeatures = &deviceFeature;
@@ -444,9 +2904,31 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 	info.ppEnabledLayerNames = actualLayers.data();
 	info.enabledExtensionCount = (uint32_t)deviceExtensions.size();
 	info.ppEnabledExtensionNames = deviceExtensions.data();
-	auto device = targetDevice->device.createDevice(info);
+	auto device = targetDevice->device.createDevice(info, hostAllocator.Callbacks());
+	DebugLabeler labeler;
+	labeler.Init(instance, device, debugUtilsEnabled);
+	MemoryBudget memoryBudget(targetDevice->device, memoryBudgetSupported);
+	if (memoryBudget.Enabled()) {
+		std::cout << "Memory budget:" << std::endl;
+	}
+	else {
+		std::cout << "VK_EXT_memory_budget unavailable, nothing is evicted under memory pressure. Heap sizes:" << std::endl;
+	}
+	memoryBudget.Print(std::cout);
 	auto presentQueue = device.getQueue(targetDevice->presentIndex, 0);
-	auto extent = ChooseSwapExtent(details.capabilities);
+	auto extent = targets.front().extent;
+	auto depthFormat = targetDevice->FindDepthFormat();
+	if (!depthFormat.has_value()) {
+		std::cerr << "Could not find supported depth format" << std::endl;
+		return false;
+	}
+	auto sampleCount = targetDevice->ChooseSampleCount(DESIRED_SAMPLE_COUNT);
+	std::cout << "Using " << (uint32_t)sampleCount << "x MSAA" << std::endl;
+	ReportAttachmentFootprint(device, targetDevice.value(), extent, targetFormat.format, depthFormat.value());
+
+	// Pipelines are shared by every target and cached across runs
+	auto pipelineCache = LoadPipelineCache(device, PIPELINE_CACHE_PATH);
+	DEBUG_NAME(labeler, pipelineCache, "Pipeline cache");
 
 	// Create shaders
 	auto fragmentCode = ::ReadFile("fragment.spv");
@@ -454,160 +2936,155 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 
 	auto fragment = CreateShaderModule(device, fragmentCode);
 	auto vertex = CreateShaderModule(device, vertexCode);
+	DEBUG_NAME(labeler, fragment, "Fragment shader");
+	DEBUG_NAME(labeler, vertex, "Vertex shader");
 
-	vk::PipelineShaderStageCreateInfo vertShaderStageInfo;
-	vertShaderStageInfo.stage = vk::ShaderStageFlagBits::eVertex;
-	vertShaderStageInfo.module = vertex;
-	vertShaderStageInfo.pName = "main";
-
-	vk::PipelineShaderStageCreateInfo fragShaderStageInfo;
-	fragShaderStageInfo.stage = vk::ShaderStageFlagBits::eFragment;
-	fragShaderStageInfo.module = fragment;
-	fragShaderStageInfo.pName = "main";
-
-	vk::PipelineShaderStageCreateInfo stages[] = { vertShaderStageInfo, fragShaderStageInfo };
-
-	vk::PipelineVertexInputStateCreateInfo vertexInputInfo;
-	vertexInputInfo.vertexBindingDescriptionCount = 0;
-	vertexInputInfo.vertexAttributeDescriptionCount = 0;
-
-	vk::PipelineInputAssemblyStateCreateInfo inputAssembly;
-	inputAssembly.topology = vk::PrimitiveTopology::eTriangleList;
-	inputAssembly.primitiveRestartEnable = false;
-
-	vk::Viewport viewport(0.0f, 0.0f, (float)extent.width, (float)extent.height, 0.0f, 1.0f);
-	vk::Rect2D scissor(vk::Offset2D(0, 0), extent);
-	std::vector<vk::DynamicState> dynamicStates = {
-		vk::DynamicState::eViewport,
-		vk::DynamicState::eScissor,
-	};
-	vk::PipelineDynamicStateCreateInfo dynamicState;
-	dynamicState.dynamicStateCount = (uint32_t)dynamicStates.size();
-	dynamicState.pDynamicStates = dynamicStates.data();
-	vk::PipelineViewportStateCreateInfo viewportState;
-	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
-	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
-
-	vk::PipelineRasterizationStateCreateInfo rasterInfo;
-	rasterInfo.depthClampEnable = false;
-	rasterInfo.rasterizerDiscardEnable = false;
-	rasterInfo.polygonMode = vk::PolygonMode::eFill;
-	rasterInfo.lineWidth = 1.0f;
-	rasterInfo.cullMode = vk::CullModeFlagBits::eBack;
-	rasterInfo.frontFace = vk::FrontFace::eClockwise;
-	rasterInfo.depthBiasClamp = false;
-
-	vk::PipelineMultisampleStateCreateInfo multisample;
-	multisample.sampleShadingEnable = false;
-	multisample.rasterizationSamples = vk::SampleCountFlagBits::e1;
-
-	vk::PipelineColorBlendAttachmentState colorblend;
-	colorblend.colorWriteMask = vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG | vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA;
-	colorblend.blendEnable = false;
-
-	vk::PipelineColorBlendStateCreateInfo colorblendInfo;
-	colorblendInfo.logicOp = vk::LogicOp::eCopy;
-	colorblendInfo.logicOpEnable = false;
-	colorblendInfo.attachmentCount = 1;
-	colorblendInfo.pAttachments = &colorblend;
-
-	vk::PipelineLayoutCreateInfo pipelineLayoutInfo;
-	auto pipelineLayout = device.createPipelineLayout(pipelineLayoutInfo);
-
-	vk::AttachmentDescription colorAttachment;
-	colorAttachment.format = targetFormat.format;
-	colorAttachment.samples = vk::SampleCountFlagBits::e1;
-	colorAttachment.loadOp = vk::AttachmentLoadOp::eClear;
-	colorAttachment.storeOp = vk::AttachmentStoreOp::eStore;
-	colorAttachment.stencilLoadOp = vk::AttachmentLoadOp::eDontCare;
-	colorAttachment.stencilStoreOp = vk::AttachmentStoreOp::eDontCare;
-	colorAttachment.initialLayout = vk::ImageLayout::eUndefined;
-	colorAttachment.finalLayout = vk::ImageLayout::ePresentSrcKHR;
-
-	vk::AttachmentReference colorAttachmentRef;
-	colorAttachmentRef.attachment = 0;
-	colorAttachmentRef.layout = vk::ImageLayout::eColorAttachmentOptimal;
-
-	vk::SubpassDescription subpass;
-	subpass.pipelineBindPoint = vk::PipelineBindPoint::eGraphics;
-	subpass.colorAttachmentCount = 1;
-	subpass.pColorAttachments = &colorAttachmentRef;
-
-	vk::SubpassDependency dependency;
-	dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-	dependency.dstSubpass = 0;
-	dependency.srcStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput;
-	dependency.srcAccessMask = vk::AccessFlagBits::eNone;
-	dependency.dstStageMask = vk::PipelineStageFlagBits::eColorAttachmentOutput;
-	dependency.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite;
-
-	vk::RenderPassCreateInfo renderPassInfo;
-	renderPassInfo.attachmentCount = 1;
-	renderPassInfo.pAttachments = &colorAttachment;
-	renderPassInfo.subpassCount = 1;
-	renderPassInfo.pSubpasses = &subpass;
-	renderPassInfo.dependencyCount = 1;
-	renderPassInfo.pDependencies = &dependency;
-	auto renderPass = device.createRenderPass(renderPassInfo);
+	auto pipelineLayout = CreateScenePipelineLayout(device);
 
-	SwapchainResources swapchainResources;
-	swapchainResources.Init(device, extent, surface, targetFormat, details.capabilities, targetMode, renderPass, targetDevice.value());
+	auto renderPass = CreateSceneRenderPass(device, targetFormat.format, depthFormat.value(), sampleCount);
+	DEBUG_NAME(labeler, renderPass, "Main render pass");
 
-	vk::GraphicsPipelineCreateInfo pipelineInfo;
-	pipelineInfo.stageCount = 2;
-	pipelineInfo.pStages = stages;
-	pipelineInfo.pVertexInputState = &vertexInputInfo;
-	pipelineInfo.pInputAssemblyState = &inputAssembly;
-	pipelineInfo.pViewportState = &viewportState;
-	pipelineInfo.pRasterizationState = &rasterInfo;
-	pipelineInfo.pMultisampleState = &multisample;
-	pipelineInfo.pDepthStencilState = nullptr;
-	pipelineInfo.pColorBlendState = &colorblendInfo;
-	pipelineInfo.pDynamicState = &dynamicState;
-	pipelineInfo.layout = pipelineLayout;
-	pipelineInfo.renderPass = renderPass;
-	pipelineInfo.subpass = 0;
+	for (size_t i = 0; i < targets.size(); i++) {
+		auto& t = targets[i];
+		t.swapchainResources.Init(device, t.extent, t.surface, targetFormat, t.details.capabilities, t.presentMode, renderPass, depthFormat.value(), sampleCount, targetDevice.value());
+#if ENABLE_DEBUG_LABELS
+		t.swapchainResources.SetDebugNames(labeler, t.DebugPrefix(i));
+#endif
+	}
 
-	auto graphicsPipeline = device.createGraphicsPipeline(nullptr, pipelineInfo);
-	if (graphicsPipeline.result != vk::Result::eSuccess) {
-		std::cerr << "Failed to create graphics pipeline: " << graphicsPipeline.result << std::endl;
-		return -1;
+	// With pipeline libraries drawing starts on a quickly linked pipeline and moves to an optimized one later
+	ScenePipelineLibrary pipelineLibrary;
+	ScenePipelineVariant sceneVariant{ vertex, fragment };
+	vk::Pipeline graphicsPipeline;
+	if (pipelineLibrarySupported) {
+		pipelineLibrary.Init(device, pipelineCache, renderPass, pipelineLayout, sampleCount, labeler);
+		graphicsPipeline = pipelineLibrary.Pipeline(sceneVariant);
+		if (!graphicsPipeline) {
+			return -1;
+		}
 	}
+	else {
+		std::cout << "Pipeline libraries unavailable, compiling the full pipeline" << std::endl;
+		auto created = CreateScenePipeline(device, pipelineCache, renderPass, pipelineLayout, vertex, fragment, sampleCount);
+		if (created.result != vk::Result::eSuccess) {
+			std::cerr << "Failed to create graphics pipeline: " << created.result << std::endl;
+			return -1;
+		}
+		graphicsPipeline = created.value;
+	}
+	DEBUG_NAME(labeler, graphicsPipeline, "Triangle pipeline");
+	DEBUG_NAME(labeler, pipelineLayout, "Triangle pipeline layout");
 
 	vk::CommandPoolCreateInfo poolInfo;
 	poolInfo.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
 	poolInfo.queueFamilyIndex = targetDevice->graphicsIndex;
-	auto commandPool = device.createCommandPool(poolInfo);
-
-	constexpr size_t MAX_FRAMES_IN_FLIGHT = 2;
-	vk::CommandBufferAllocateInfo cbai;
-	cbai.commandPool = commandPool;
-	cbai.level = vk::CommandBufferLevel::ePrimary;
-	cbai.commandBufferCount = MAX_FRAMES_IN_FLIGHT;
-	auto commandBuffers = device.allocateCommandBuffers(cbai);
+	auto commandPool = device.createCommandPool(poolInfo, hostAllocator.Callbacks());
 
-	std::vector<ResourcePerFrame> frameResources(MAX_FRAMES_IN_FLIGHT);
+	DEBUG_NAME(labeler, commandPool, "Graphics command pool");
 
-	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
-		auto& rpf = frameResources[i];
-		rpf.imageAvailable = device.createSemaphore(vk::SemaphoreCreateInfo());
-		rpf.renderFinished = device.createSemaphore(vk::SemaphoreCreateInfo());
-		rpf.inFlight = device.createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled));
+	constexpr size_t MAX_FRAMES_IN_FLIGHT = 2;
+	for (size_t i = 0; i < targets.size(); i++) {
+		auto& t = targets[i];
+		vk::CommandBufferAllocateInfo cbai;
+		cbai.commandPool = commandPool;
+		cbai.level = vk::CommandBufferLevel::ePrimary;
+		cbai.commandBufferCount = MAX_FRAMES_IN_FLIGHT;
+		t.commandBuffers = device.allocateCommandBuffers(cbai);
+		t.frames.resize(MAX_FRAMES_IN_FLIGHT);
+		for (size_t f = 0; f < MAX_FRAMES_IN_FLIGHT; f++) {
+			auto& frame = t.frames[f];
+			frame.renderFinished = device.createSemaphore(vk::SemaphoreCreateInfo(), hostAllocator.Callbacks());
+			frame.inFlight = device.createFence(vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled), hostAllocator.Callbacks());
+			DEBUG_NAME(labeler, frame.renderFinished, t.DebugPrefix(i) + "Render finished " + std::to_string(f));
+			DEBUG_NAME(labeler, frame.inFlight, t.DebugPrefix(i) + "In flight " + std::to_string(f));
+			DEBUG_NAME(labeler, t.commandBuffers[f], t.DebugPrefix(i) + "Frame command buffer " + std::to_string(f));
+		}
 	}
 	auto graphicsQueue = device.getQueue(targetDevice->graphicsIndex, 0);
-	RECT rect;
-	if (!GetWindowRect(hwnd.value(), &rect)) {
-		std::cerr << "Failed to get window size" << std::endl;
-		return -1;
+	DEBUG_NAME(labeler, graphicsQueue, "Graphics queue");
+
+	// The source stays mapped for the whole run so an evicted mesh can be streamed back in
+	std::vector<uint8_t> triangle;
+	std::unique_ptr<MappedFile> meshFile;
+	const uint8_t* meshData;
+	size_t meshSize;
+	if (options.meshPath.empty()) {
+		triangle = BuiltinTriangleMesh();
+		meshData = triangle.data();
+		meshSize = triangle.size();
+	}
+	else {
+		meshFile = std::make_unique<MappedFile>(options.meshPath);
+		meshData = meshFile->Data();
+		meshSize = meshFile->Size();
+	}
+	std::vector<vk::Fence> inFlightFences;
+	for (const auto& t : targets) {
+		for (const auto& frame : t.frames) {
+			inFlightFences.push_back(frame.inFlight);
+		}
+	}
+	StreamedMesh streamedMesh(device, targetDevice.value(), graphicsQueue, commandPool, memoryBudget, inFlightFences, labeler, meshData, meshSize);
+	if (meshFile) {
+		std::cout << "Loaded " << options.meshPath.string() << ": " << streamedMesh.Mesh().indexCount / 3 << " triangles" << std::endl;
+	}
+
+	// Placed by the full mesh's constants, which the fallback is drawn with as well
+	Scene scene;
+	scene.Init(streamedMesh.Mesh().constants, SCENE_GRID_SIZE, SCENE_SPACING);
+	// Culling runs on the update thread plus workers while the render thread records, so leave two cores
+	FrustumCuller culler(std::max(2u, std::thread::hardware_concurrency()) - 2);
+	std::cout << "Culling " << scene.Bounds().Count() << " objects with " << CullPathName(culler.Path())
+		<< " on " << culler.ThreadCount() << " threads" << std::endl;
+	// Frame 0 is updated up front, later frames one frame ahead of recording
+	UpdateStage updateStage(scene, culler);
+	auto startTime = std::chrono::steady_clock::now();
+	updateStage.Kick(0.0);
+	CpuFrameStats cpuStats;
+	AllocationWatch allocationWatch(hostAllocator, ALLOCATION_WARMUP_FRAMES);
+	// Per frame lists keep their capacity across frames
+	std::vector<PresentTarget*> ready;
+	std::vector<vk::Semaphore> presentWaits;
+	std::vector<vk::SwapchainKHR> swapchains;
+	std::vector<uint32_t> imageIndices;
+	std::vector<vk::Result> presentResults;
+
+	// The scene color target and the swapchain images share a format. Blitting between them needs blit support
+	// on both ends, and a linear filter also needs linear sampling. Without blits there is no upscale, so the
+	// scene is rendered at full resolution and copied.
+	auto formatFeatures = targetDevice->device.getFormatProperties(targetFormat.format).optimalTilingFeatures;
+	std::optional<vk::Filter> upscaleFilter;
+	if ((formatFeatures & vk::FormatFeatureFlagBits::eBlitSrc) && (formatFeatures & vk::FormatFeatureFlagBits::eBlitDst)) {
+		upscaleFilter = (formatFeatures & vk::FormatFeatureFlagBits::eSampledImageFilterLinear) ? vk::Filter::eLinear : vk::Filter::eNearest;
+	}
+	else {
+		std::cout << vk::to_string(targetFormat.format) << " can't be blitted, dynamic resolution disabled" << std::endl;
+	}
+	for (size_t i = 0; i < targets.size(); i++) {
+		auto& t = targets[i];
+		if (!upscaleFilter.has_value()) {
+			t.resolution = ResolutionController(TARGET_GPU_FRAME_MS, 1.0, 1.0);
+		}
+		t.gpuTimer.Init(device, targetDevice.value(), MAX_FRAMES_IN_FLIGHT);
+		t.imageAvailable.resize(MAX_FRAMES_IN_FLIGHT);
+		for (size_t f = 0; f < MAX_FRAMES_IN_FLIGHT; f++) {
+			t.imageAvailable[f] = device.createSemaphore(vk::SemaphoreCreateInfo(), hostAllocator.Callbacks());
+			DEBUG_NAME(labeler, t.imageAvailable[f], t.DebugPrefix(i) + "Image available " + std::to_string(f));
+		}
+		if (!t.hwnd.has_value()) {
+			continue;
+		}
+		RECT rect;
+		if (!GetWindowRect(t.hwnd.value(), &rect)) {
+			std::cerr << "Failed to get window size" << std::endl;
+			return -1;
+		}
+		t.eventDetector = std::make_unique<EventDetector>(rect.right - rect.left, rect.bottom - rect.top);
+		SetWindowLongPtr(t.hwnd.value(), GWLP_USERDATA, (LONG_PTR)t.eventDetector.get());
 	}
-	EventDetector eventDetector(rect.right - rect.left, rect.bottom - rect.top);
-	SetWindowLongPtr(hwnd.value(), GWLP_USERDATA, (LONG_PTR)&eventDetector);
 	// メイン メッセージ ループ:
 	HACCEL hAccelTable = LoadAccelerators(hInstance, MAKEINTRESOURCE(IDC_VULKANSAMPLE));
 	bool rendering = true;
-	size_t numFrames = 0;
 	while (rendering)
 	{
 		MSG msg;
@@ -624,66 +3101,209 @@ int APIENTRY wWinMain(_In_ HINSTANCE hInstance,
 			}
 		}
 		else {
-			Sleep(10);
-			if (eventDetector.AreaIsZero()) {
-				// Don't render when window area is zero
+			allocationWatch.BeginFrame();
+			memoryBudget.Update();
+			if (memoryBudget.Pressure() > MemoryBudget::EVICT_RATIO) {
+				auto released = memoryBudget.EvictIfNeeded();
+				if (released > 0) {
+					std::cout << "Memory pressure, evicted " << released / 1024 << " KiB" << std::endl;
+					memoryBudget.Print(std::cout);
+					allocationWatch.Reset();
+				}
+			}
+			if (streamedMesh.Update()) {
+				allocationWatch.Reset();
+			}
+
+			// Pick the targets that can start a frame right now. Each one is paced by its own fences and
+			// swapchain and nothing here blocks, so a vblank paced target never holds back the others.
+			ready.clear();
+			for (size_t i = 0; i < targets.size(); i++) {
+				auto& t = targets[i];
+				auto slot = t.frameIndex % MAX_FRAMES_IN_FLIGHT;
+				auto& frame = t.frames[slot];
+				auto idle = device.getFenceStatus(frame.inFlight) == vk::Result::eSuccess;
+				if (idle) {
+					// Read even for targets skipped this frame, so a target that comes back doesn't see an old result
+					auto gpuMs = t.gpuTimer.ResultMs(device, (uint32_t)slot);
+					if (gpuMs.has_value() && t.resolution.Update(gpuMs.value())) {
+						std::cout << "Target " << i << " GPU time " << gpuMs.value() << " ms, render scale " << t.resolution.Scale() << std::endl;
+					}
+				}
+				if (t.eventDetector && t.eventDetector->AreaIsZero()) {
+					// Don't render when window area is zero
+					continue;
+				}
+				auto resized = t.eventDetector && t.eventDetector->Resized();
+				if (resized || t.outOfDate) {
+					// The capabilities queried at startup still describe the old size, so ask the surface again
+					device.waitIdle();
+					t.details.capabilities = targetDevice->device.getSurfaceCapabilitiesKHR(t.surface);
+					t.extent = ChooseSwapExtent(t.details.capabilities, t.eventDetector ? t.eventDetector->Extent() : t.extent);
+					if (t.extent.width == 0 || t.extent.height == 0) {
+						// Minimized between the resize message and now, try again once it has an area
+						continue;
+					}
+					std::cout << (resized ? "Resizing" : "Recreating") << " swapchain " << i << " at " << t.extent.width << "x" << t.extent.height << std::endl;
+					auto committed = t.swapchainResources.scene.TransientCommitted(device);
+					std::cout << "Transient attachments had " << committed / 1024 << " KiB committed" << std::endl;
+					t.swapchainResources.Cleanup(device);
+					t.swapchainResources.Init(device, t.extent, t.surface, targetFormat, t.details.capabilities, t.presentMode, renderPass, depthFormat.value(), sampleCount, targetDevice.value());
+#if ENABLE_DEBUG_LABELS
+					t.swapchainResources.SetDebugNames(labeler, t.DebugPrefix(i));
+#endif
+					if (t.eventDetector) {
+						t.eventDetector->ResetResize();
+					}
+					t.outOfDate = false;
+					idle = true;
+					allocationWatch.Reset();
+				}
+				if (!idle) {
+					continue;
+				}
+				// A zero timeout skips a target without a free image instead of waiting for it
+				try {
+					auto acquired = device.acquireNextImageKHR(t.swapchainResources.swapchain, 0, t.imageAvailable[slot], nullptr);
+					if (acquired.result == vk::Result::eTimeout || acquired.result == vk::Result::eNotReady) {
+						continue;
+					}
+					// Suboptimal images can still be presented, the swapchain is recreated afterwards
+					t.outOfDate = acquired.result == vk::Result::eSuboptimalKHR;
+					t.imageIndex = acquired.value;
+				}
+				catch (const vk::OutOfDateKHRError&) {
+					t.outOfDate = true;
+					continue;
+				}
+				ready.push_back(&t);
+			}
+			if (ready.empty()) {
+				// Every target is minimized or still busy with its earlier frames
+				Sleep(1);
 				continue;
 			}
-			else if (eventDetector.Resized()) {
-				// Update buffer size based on new window size
-				extent = eventDetector.Extent();
-				std::cout << "Resizing swapchain to " << extent.width << "x" << extent.height << std::endl;
-				device.waitIdle();
-				swapchainResources.Cleanup(device);
-				swapchainResources.Init(device, extent, surface, targetFormat, details.capabilities, targetMode, renderPass, targetDevice.value());
-				eventDetector.ResetResize();
-			}
-			const size_t commandBufferIndex = numFrames % MAX_FRAMES_IN_FLIGHT;
-			auto& cb = commandBuffers[commandBufferIndex];
-			auto& rpf = frameResources[commandBufferIndex];
-			// render
-			auto result = device.waitForFences(rpf.inFlight, true, UINT64_MAX);
-			device.resetFences(rpf.inFlight);
-			auto index = device.acquireNextImageKHR(swapchainResources.swapchain, UINT64_MAX, rpf.imageAvailable, nullptr);
-			cb.reset();
-			RecordCommandBuffer(cb, renderPass, swapchainResources.frameBuffers[index.value], extent, graphicsPipeline.value);
-			vk::SubmitInfo submitInfo;
-			submitInfo.waitSemaphoreCount = 1;
-			submitInfo.pWaitSemaphores = &rpf.imageAvailable;
-			vk::PipelineStageFlags waitStages[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
-			submitInfo.pWaitDstStageMask = waitStages;
-			submitInfo.commandBufferCount = 1;
-			submitInfo.pCommandBuffers = &cb;
-			submitInfo.signalSemaphoreCount = 1;
-			submitInfo.pSignalSemaphores = &rpf.renderFinished;
-			graphicsQueue.submit(submitInfo, rpf.inFlight);
+
+			// The optimized link allocates through the same callbacks, so frames overlapping it are not steady state
+			if (pipelineLibrary.Optimizing()) {
+				allocationWatch.Reset();
+			}
+			if (pipelineLibrary.Update()) {
+				graphicsPipeline = pipelineLibrary.Pipeline(sceneVariant);
+				DEBUG_NAME(labeler, graphicsPipeline, "Triangle pipeline (optimized)");
+			}
+
+			// Take this frame's snapshot and immediately start on the next one
+			const auto& snapshot = updateStage.Wait();
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+			updateStage.Kick(elapsed.count());
+
+			// Every ready target gets its own command buffer and submit, signaling only its own fence
+			const auto& mesh = streamedMesh.Mesh();
+			std::chrono::duration<double, std::milli> recordMs(0.0);
+			presentWaits.clear();
+			swapchains.clear();
+			imageIndices.clear();
+			for (auto* target : ready) {
+				auto& t = *target;
+				auto slot = t.frameIndex % MAX_FRAMES_IN_FLIGHT;
+				auto& frame = t.frames[slot];
+				auto& cb = t.commandBuffers[slot];
+				auto recordStart = std::chrono::steady_clock::now();
+				device.resetFences(frame.inFlight);
+				cb.reset();
+				cb.begin(vk::CommandBufferBeginInfo());
+				// Times the scene pass only since that is the part the render scale affects
+				t.gpuTimer.Begin(cb, (uint32_t)slot);
+				auto renderExtent = t.resolution.Apply(t.extent);
+				RecordCommandBuffer(cb, renderPass, t.swapchainResources.scene.frameBuffer, renderExtent, graphicsPipeline, pipelineLayout, mesh, scene, snapshot.camera, snapshot.visible, labeler);
+				t.gpuTimer.End(cb, (uint32_t)slot);
+				RecordUpscale(cb, t.swapchainResources.scene.color.image, renderExtent, t.swapchainResources.images[t.imageIndex], t.extent, upscaleFilter, labeler);
+				cb.end();
+				recordMs += std::chrono::steady_clock::now() - recordStart;
+
+				vk::SubmitInfo submitInfo;
+				submitInfo.waitSemaphoreCount = 1;
+				submitInfo.pWaitSemaphores = &t.imageAvailable[slot];
+				// Swapchain images are first touched by the upscale blit
+				vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eTransfer;
+				submitInfo.pWaitDstStageMask = &waitStage;
+				submitInfo.commandBufferCount = 1;
+				submitInfo.pCommandBuffers = &cb;
+				submitInfo.signalSemaphoreCount = 1;
+				submitInfo.pSignalSemaphores = &frame.renderFinished;
+				labeler.BeginQueueRegion(graphicsQueue, "Frame submit", { 1.0f, 0.5f, 0.0f, 1.0f });
+				graphicsQueue.submit(submitInfo, frame.inFlight);
+				labeler.EndQueueRegion(graphicsQueue);
+				presentWaits.push_back(frame.renderFinished);
+				swapchains.push_back(t.swapchainResources.swapchain);
+				imageIndices.push_back(t.imageIndex);
+				t.frameIndex++;
+			}
+			cpuStats.Add(snapshot.cpuMs, recordMs.count());
+			if (cpuStats.Full()) {
+				cpuStats.Print(std::cout);
+			}
+
+			// One present call for the ready targets. pResults reports every swapchain on its own, so an out of
+			// date target is only flagged for recreation and the others keep going.
+			presentResults.assign(swapchains.size(), vk::Result::eSuccess);
 			vk::PresentInfoKHR pi;
-			pi.waitSemaphoreCount = 1;
-			pi.pWaitSemaphores = &rpf.renderFinished;
-			pi.swapchainCount = 1;
-			pi.pSwapchains = &swapchainResources.swapchain;
-			pi.pImageIndices = &index.value;
-			result = presentQueue.presentKHR(pi);
-			numFrames++;
+			pi.waitSemaphoreCount = (uint32_t)presentWaits.size();
+			pi.pWaitSemaphores = presentWaits.data();
+			pi.swapchainCount = (uint32_t)swapchains.size();
+			pi.pSwapchains = swapchains.data();
+			pi.pImageIndices = imageIndices.data();
+			pi.pResults = presentResults.data();
+			labeler.BeginQueueRegion(presentQueue, "Present", { 0.0f, 1.0f, 0.5f, 1.0f });
+			try {
+				auto presented = presentQueue.presentKHR(pi);
+			}
+			catch (const vk::OutOfDateKHRError&) {
+				// Which swapchains are out of date is in presentResults
+			}
+			labeler.EndQueueRegion(presentQueue);
+			for (size_t i = 0; i < ready.size(); i++) {
+				if (presentResults[i] == vk::Result::eErrorOutOfDateKHR || presentResults[i] == vk::Result::eSuboptimalKHR) {
+					ready[i]->outOfDate = true;
+				}
+			}
+			allocationWatch.EndFrame();
 		}
 	}
 	// Wait for idle before destroying resources since they may still be in use
 	device.waitIdle();
-	swapchainResources.Cleanup(device);
-	for (auto& rpf : frameResources) {
-		device.destroySemaphore(rpf.imageAvailable);
-		device.destroySemaphore(rpf.renderFinished);
-		device.destroyFence(rpf.inFlight);
-	}
-	device.destroyCommandPool(commandPool);
-	device.destroyPipeline(graphicsPipeline.value);
-	device.destroyRenderPass(renderPass);
-	device.destroyPipelineLayout(pipelineLayout);
-	device.destroyShaderModule(fragment);
-	device.destroyShaderModule(vertex);
-	device.destroy();
-	instance.destroySurfaceKHR(surface);
-	instance.destroy();
+	for (auto& t : targets) {
+		t.swapchainResources.Cleanup(device);
+		t.gpuTimer.Cleanup(device);
+		for (auto& s : t.imageAvailable) {
+			device.destroySemaphore(s, hostAllocator.Callbacks());
+		}
+		for (auto& frame : t.frames) {
+			device.destroySemaphore(frame.renderFinished, hostAllocator.Callbacks());
+			device.destroyFence(frame.inFlight, hostAllocator.Callbacks());
+		}
+	}
+	streamedMesh.Cleanup();
+	device.destroyCommandPool(commandPool, hostAllocator.Callbacks());
+	if (pipelineLibrarySupported) {
+		pipelineLibrary.Cleanup(device);
+	}
+	else {
+		device.destroyPipeline(graphicsPipeline, hostAllocator.Callbacks());
+	}
+	SavePipelineCache(device, pipelineCache, PIPELINE_CACHE_PATH);
+	device.destroyPipelineCache(pipelineCache, hostAllocator.Callbacks());
+	device.destroyRenderPass(renderPass, hostAllocator.Callbacks());
+	device.destroyPipelineLayout(pipelineLayout, hostAllocator.Callbacks());
+	device.destroyShaderModule(fragment, hostAllocator.Callbacks());
+	device.destroyShaderModule(vertex, hostAllocator.Callbacks());
+	device.destroy(hostAllocator.Callbacks());
+	for (auto& t : targets) {
+		instance.destroySurfaceKHR(t.surface, hostAllocator.Callbacks());
+	}
+	instance.destroy(hostAllocator.Callbacks());
+	allocationWatch.Print(std::cout);
 
 	return 0;
 }
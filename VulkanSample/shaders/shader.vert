@@ -1,20 +1,31 @@
 #version 450
 
-layout(location = 0) out vec3 fragColor;
+// Quantized attributes from MeshFormat.h, expanded to floats by the vertex fetch
+layout(location = 0) in vec4 inPosition; // unorm16 within the mesh bounds
+layout(location = 1) in vec2 inNormal;   // snorm16 octahedral encoding
+layout(location = 2) in vec2 inUV;       // unorm16 within the UV bounds
+
+// Dequantization with the fit to view transform folded in, see MeshConstants
+layout(push_constant) uniform MeshConstants {
+    vec4 positionScale;
+    vec4 positionOffset;
+    vec4 uvScaleOffset;
+} mesh;
 
-vec2 positions[3] = vec2[](
-    vec2(0.0, -0.5),
-    vec2(0.5, 0.5),
-    vec2(-0.5, 0.5)
-);
+layout(location = 0) out vec3 fragColor;
 
-vec3 colors[3] = vec3[](
-    vec3(1.0, 0.0, 0.0),
-    vec3(0.0, 1.0, 0.0),
-    vec3(0.0, 0.0, 1.0)
-);
+// Must stay in sync with OctDecode in MeshFormat.h
+vec3 OctDecode(vec2 e) {
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    if (n.z < 0.0) {
+        n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    }
+    return normalize(n);
+}
 
 void main() {
-    gl_Position = vec4(positions[gl_VertexIndex], 0.0, 1.0);
-    fragColor = colors[gl_VertexIndex];
-}
\ No newline at end of file
+    gl_Position = vec4(inPosition.xyz * mesh.positionScale.xyz + mesh.positionOffset.xyz, 1.0);
+    vec3 normal = OctDecode(inNormal);
+    vec2 uv = inUV * mesh.uvScaleOffset.xy + mesh.uvScaleOffset.zw;
+    fragColor = (normal * 0.5 + 0.5) * mix(vec3(1.0), vec3(fract(uv), 1.0), 0.25);
+}